@@ -38,6 +38,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+// Used by the allocation profiler's lock.
+#include <sched.h>
 
 #include "death.h"
 #include "core.h"
@@ -64,7 +66,7 @@ continuation newContinuation(void *origin,
                              vector scope,
                              vector env,
                              vector old) {
-  return newVector(8, origin, selector, evaluated, unevaluated, scope, env, NULL, old);
+  return newVector(9, origin, selector, evaluated, unevaluated, scope, env, NULL, old, NULL);
 }
 
 void *oldContinuation(continuation c) {
@@ -90,6 +92,13 @@ void setEvaluated(continuation c, vector v)   { setIdx(c, 2, v); }
 void setUnevaluated(continuation c, vector v) { setIdx(c, 3, v); }
 void setEnv(continuation c, obj o)            { setIdx(c, 4, o); }
 
+// The inline cache of the expression that sent the message, if any.
+vector callSite(continuation c) { return idx(c, 8); }
+continuation setCallSite(continuation c, vector cache) {
+  setIdx(c, 8, cache);
+  return c;
+}
+
 int isVisible(continuation c, obj namespace) {
   vector namespaces = hiddenEntity(dynamicEnv(c));
   for (int i = 0; i < vectorLength(namespaces); ++i)
@@ -127,13 +136,14 @@ vector subexpressionContinuation(continuation parent,
     fulfillPromise(c, value); \
     escape; \
   }   \
-  setContinuation(newContinuation(origin(c), \
-                                  selector(c), \
-                                  suffix(value, evaluated(c)), \
-                                  unevaluated(c), \
-                                  env(c), \
-                                  dynamicEnv(c), \
-                                  oldContinuation(c))); \
+  setContinuation(setCallSite(newContinuation(origin(c), \
+                                              selector(c), \
+                                              suffix(value, evaluated(c)), \
+                                              unevaluated(c), \
+                                              env(c), \
+                                              dynamicEnv(c), \
+                                              oldContinuation(c)), \
+                              callSite(c))); \
 } while (0)
 
 #define gotoNext return 0
@@ -196,14 +206,18 @@ vector vectorAppend(vector v1, vector v2) {
   vector v3 = makeVector(length1 + length2);
   memcpy(vectorData(v3), vectorData(v1), length1 * sizeof(atom));
   memcpy((void *)vectorData(v3) + length1 * sizeof(atom), vectorData(v2), length2 * sizeof(atom));
-  return v3;
+  return shadeReferences(v3);
 }
 
+int slotIndex(obj o, obj name, vector c) {
+  vector shape = objectShape(o), layout = shapeLayout(shape);
+  for (int cursor = -1, i; (i = nextSlotNamed(shape, name, &cursor)) >= 0;)
+    if (isVisible(c, idx(layout, i * 2 + 1))) return i;
+  return -1;
+}
 void **shallowLookup(obj o, obj name, vector c) {
-  for (int i = 0; i < slotCount(o); ++i)
-    if (slotName(o, i) == name && isVisible(c, slotNamespace(o, i)))
-      return slotValuePointer(o, i);
-  return 0;
+  int i = slotIndex(o, name, c);
+  return i < 0 ? 0 : slotValuePointer(o, i);
 }
 void **deepLookup(obj o, obj name, continuation c) {
   void **slot;
@@ -216,7 +230,7 @@ obj addCanonSlot(obj o, obj s, void *v) {
 }
 obj addSlot(obj o, obj s, void *v, continuation c) {
   void **slot = shallowLookup(o, s, c);
-  return slot ? *slot = v : newSlot(o, s, v, currentNamespace(c));
+  return slot ? *slot = writeBarrier(v) : newSlot(o, s, v, currentNamespace(c));
 }
 
 void invokeDispatchMethod(void);
@@ -237,15 +251,126 @@ vector methodContinuation(vector c, vector args, obj method) {
 
 void doNext(void);
 
+// Each call site remembers where the selector was found for the last few receiver shapes and protos, as an
+// entry of
+//   <lookupEpoch> <shape> <proto> <namespaces> <holder, or null for the receiver> <slot index, or -1 to
+//   dispatch to the holder>
+// A slot of the receiver's own is found by its shape alone, so those entries leave out the proto.
+// Entries are never changed once made, so that other threads may read them while they're replaced.
+#ifndef INLINE_CACHE_ENTRIES
+  #define INLINE_CACHE_ENTRIES 4
+#endif
+
+vector newInlineCache() {
+  return makeVector(INLINE_CACHE_ENTRIES);
+}
+void fillInlineCache(vector cache, int i, atom epoch, obj shape, obj p, obj namespaces, obj holder, int index) {
+  vector e = newAtomVector(6, (void *)epoch, shape, p, namespaces, holder, (void *)(atom)index);
+  __sync_synchronize(); // Before it's published.
+  setIdx(cache, i, e);
+}
+
+// Sends without a call site, and call sites that miss, go through a global cache of the same lookups, hashed
+// on the shape, proto, selector and namespaces. It lives outside the heap, which is safe as long as it's only
+// trusted within the lookupEpoch that an entry was made in. An entry's sequence number is odd while it's
+// being written.
+#ifndef LOOKUP_CACHE_ENTRIES
+  #define LOOKUP_CACHE_ENTRIES 4096 // A power of two.
+#endif
+
+typedef struct {
+  volatile atom sequence, epoch;
+  obj shape, proto, selector, namespaces, holder;
+  int index;
+} lookupCacheEntry;
+
+lookupCacheEntry lookupCache[LOOKUP_CACHE_ENTRIES];
+
+lookupCacheEntry *lookupCacheEntryFor(obj shape, obj p, obj selector, obj namespaces) {
+  atom h = (atom)shape * 127 + (atom)p * 31 + (atom)selector * 7 + (atom)namespaces;
+  return &lookupCache[(h ^ h >> 12) / sizeof(atom) & LOOKUP_CACHE_ENTRIES - 1];
+}
+int cachedLookup(atom epoch, obj shape, obj p, obj selector, obj namespaces, obj *holder, int *index) {
+  lookupCacheEntry *e = lookupCacheEntryFor(shape, p, selector, namespaces);
+  atom sequence = e->sequence;
+  if (sequence & 1 || e->epoch != epoch || e->shape != shape || e->proto != p || e->selector != selector
+      || e->namespaces != namespaces)
+    return 0;
+  *holder = e->holder;
+  *index = e->index;
+  __sync_synchronize();
+  return e->sequence == sequence;
+}
+void rememberLookup(atom epoch, obj shape, obj p, obj selector, obj namespaces, obj holder, int index) {
+  lookupCacheEntry *e = lookupCacheEntryFor(shape, p, selector, namespaces);
+  atom sequence = e->sequence;
+  if (sequence & 1 || !__sync_bool_compare_and_swap(&e->sequence, sequence, sequence + 1)) return;
+  e->epoch = epoch;
+  e->shape = shape;
+  e->proto = p;
+  e->selector = selector;
+  e->namespaces = namespaces;
+  e->holder = holder;
+  e->index = index;
+  __sync_synchronize();
+  e->sequence = sequence + 2;
+}
+
+// Whether the object will outlive every minor collection, as everything a lookup cache holds must.
+int isOld(obj o) { return !o || isMarked(o); }
+
+// Look the name up in the receiver, and then from its proto onwards as far as the first object with its own
+// dispatch method, through the call site's cache, if any. Returns the object holding the slot, with its
+// index, or that object, with -1.
+obj lookupName(continuation c, vector cache, obj name, obj r, int *index) {
+  obj namespaces = hiddenEntity(dynamicEnv(c)), shape = objectShape(r), p = proto(r), o;
+  atom epoch = lookupEpoch;
+  int victim = (atom)shape / sizeof(atom) % INLINE_CACHE_ENTRIES;
+  if (cache) {
+    for (int i = 0; i < INLINE_CACHE_ENTRIES; ++i) {
+      vector v = idx(cache, i);
+      atom *e = v ? vectorData(v) : NULL;
+      if (!e || e[0] != epoch) {
+        victim = i;
+        continue;
+      }
+      if ((obj)e[1] == shape && (!e[4] || (obj)e[2] == p) && (obj)e[3] == namespaces) {
+        *index = e[5];
+        return (obj)e[4] ?: r;
+      }
+    }
+  }
+  if (cachedLookup(epoch, shape, p, name, namespaces, &o, index)) {
+    if (cache) fillInlineCache(cache, victim, epoch, shape, o ? p : NULL, namespaces, o, *index);
+    return o ?: r;
+  }
+  // Only lookups through old objects are remembered.
+  int old = isOld(shape) && isOld(p) && isOld(name) && isOld(namespaces);
+  if ((*index = slotIndex(r, name, c)) < 0) {
+    for (o = p; !dispatchMethod(o) && (*index = slotIndex(o, name, c)) < 0; o = proto(o))
+      old = old && isMarked(o);
+    if (dispatchMethod(o)) *index = -1;
+    old = old && isMarked(o);
+  } else o = NULL;
+  if (old) {
+    rememberLookup(epoch, shape, p, name, namespaces, o, *index);
+    if (cache) fillInlineCache(cache, victim, epoch, shape, o ? p : NULL, namespaces, o, *index);
+  }
+  return o ?: r;
+}
+obj lookup(continuation c, obj r, int *index) {
+  return lookupName(c, callSite(c), selector(c), r, index);
+}
+
 void normalDispatchMethod() {
   vector c = threadContinuation(currentThread);
-  obj r = receiver(c);
-  void **slot = shallowLookup(r, selector(c), c);
-  if (!slot) {
-    setThreadReceiver(currentThread, proto(r));
+  int i;
+  obj holder = lookup(c, receiver(c), &i);
+  if (i < 0) {
+    setThreadReceiver(currentThread, holder);
     tailcall(invokeDispatchMethod);
   }
-  obj contents = *slot;
+  obj contents = *slotValuePointer(holder, i);
 
   if (isPrimitive(contents)) callPrimitiveMethod(contents);
   if (isMethod(contents)) {
@@ -290,16 +415,26 @@ void dispatch() {
   tailcall(invokeDispatchMethod);
 }
 
+int interpretsAsCode(continuation, obj);
+continuation codeContinuation(void *, continuation, obj);
+
 // The heart of the interpreter, called at the end of each expression to evaluate the next one.
 void doNext() {
-  shelter(currentThread, 0); // Release temporary allocations from the last subexpression.
+  invalidateEden(); // Release temporary allocations from the last subexpression.
+  safepoint();
   continuation c = threadContinuation(currentThread);
   int evaluatedCount = vectorLength(evaluated(c)),
       unevaluatedCount = vectorLength(unevaluated(c));
   // Have we evaluated all the subexpressions?
   if (evaluatedCount >= unevaluatedCount) tailcall(dispatch);
-  // If not, evaluate the next subexpression.
-  vector subexpr = newVector(1, idx(unevaluated(c), evaluatedCount));
+  // If not, evaluate the next subexpression. Code, which most of them are, is started on here, rather than
+  // sent interpret, unless that would find some other method.
+  obj next = idx(unevaluated(c), evaluatedCount);
+  if (interpretsAsCode(c, next)) {
+    setContinuation(codeContinuation(c, c, next));
+    tailcall(doNext);
+  }
+  vector subexpr = newVector(1, next);
   setContinuation(newContinuation(c,
                                   sInterpret,
                                   subexpr,
@@ -321,7 +456,9 @@ obj callWithState(obj scope, obj env, obj target, obj selector, vector args) {
                                             newVector(2,
                                                       threadContinuation(currentThread),
                                                       shelteredValue(currentThread))));   
+  int floor = protectEden();
   doNext();
+  restoreEden(floor);
   vector oc = oldContinuation(threadContinuation(currentThread));
   shelter(currentThread, idx(oc, 1));
   setContinuation(idx(oc, 0));
@@ -362,14 +499,46 @@ int isQuote(obj o) { return -1; } // FIXME: How do we test for this without addi
 obj  codeTarget(obj c)   { return idx(hiddenEntity(c), 0); }
 obj  codeSelector(obj c) { return idx(hiddenEntity(c), 1); }
 pair codeArgs(obj c)     { return idx(hiddenEntity(c), 2); }
-obj setCodeTarget(obj c, obj t) { return setIdx(hiddenEntity(c), 0, t); }
-int isCode(obj c) { return vectorLength(hiddenEntity(c)) == 3; } // FIXME: Find a better test.
+obj setCodeTarget(obj c, obj t) {
+  setIdx(hiddenEntity(c), 4, NULL);
+  return setIdx(hiddenEntity(c), 0, t);
+}
+int isCode(obj c) { return vectorLength(hiddenEntity(c)) == 5; } // FIXME: Find a better test.
+// Made the first time the code is interpreted.
+vector codeInlineCache(obj c) {
+  return idx(hiddenEntity(c), 3) ?: setIdx(hiddenEntity(c), 3, newInlineCache());
+}
+// The target followed by the arguments, for the continuation that evaluates them. Made the first time the
+// code is interpreted, since no continuation changes them.
+vector codeOperands(obj c) {
+  return idx(hiddenEntity(c), 4) ?: setIdx(hiddenEntity(c), 4, prefix(codeTarget(c), codeArgs(c)));
+}
+continuation codeContinuation(void *origin, continuation c, obj code) {
+  return setCallSite(newContinuation(origin,
+                                     codeSelector(code),
+                                     emptyVector,
+                                     codeTarget(code) ? codeOperands(code) : prefix(env(c), codeArgs(code)),
+                                     env(c),
+                                     dynamicEnv(c),
+                                     oldContinuation(c)),
+                     codeInlineCache(code));
+}
+
+int mCodeInterpret(void);
+
+// Whether sending interpret to the object would run the built-in method for code.
+int interpretsAsCode(continuation c, obj o) {
+  if (isPromise(o) || isActor(o) || proto(o) != oCode || !isCode(o) || dispatchMethod(o)) return 0;
+  int i;
+  obj holder = lookupName(c, NULL, sInterpret, o, &i), m;
+  return i >= 0 && isPrimitive(m = *slotValuePointer(holder, i)) && primitiveCode(m) == mCodeInterpret;
+}
 
 obj message(obj target, obj selector, vector args) {
-  return slotlessObject(oCode, newVector(3, target, selector, args));
+  return slotlessObject(oCode, newVector(5, target, selector, args, NULL, NULL));
 }
 obj setMessageTarget(obj message, obj target) {
-  setIdx(hiddenEntity(message), 0, target);
+  setCodeTarget(message, target);
   return message;
 }
 obj expressionSequence(vector exprs) {
@@ -388,7 +557,7 @@ int arity() {
   return vectorLength(evaluated(threadContinuation(currentThread))) - 1;
 }
 
-obj integer(int v) {
+obj integer(long v) {
   obj i = emptyBignum();
   mpz_init_set_si(bignumData(i), v);
   return i;
@@ -397,6 +566,153 @@ int integerValue(obj i) {
   return mpz_get_si(bignumData(i));
 }
 
+void freeRegex(vector v) {
+  regfree(vectorData(v));
+}
+// A file descriptor is kept as the hidden data of its stream, so that it can be closed if the stream is
+// collected while still open. Closing it explicitly sets it to -1.
+void closeDescriptor(vector v) {
+  atom fd = *(atom *)vectorData(v);
+  if (fd != -1) close(fd);
+}
+vector descriptorVector(int fd) {
+  return registerFinalizer(newAtomVector(1, (void *)(atom)fd), closeDescriptor);
+}
+void forgetDescriptor(obj stream, int fd) {
+  vector v = hiddenEntity(stream);
+  if (v && vectorLength(v) == 1 && *(atom *)vectorData(v) == fd) *(atom *)vectorData(v) = -1;
+}
+
+// An ephemeron table keeps each entry in an ephemeron, which the collector empties once the key can't be
+// reached except through it. Keys are compared by identity, and an emptied entry is reused by the next new key.
+#define EPHEMERON_TABLE_CAPACITY 8
+
+vector ephemerons(int n) {
+  vector v = makeVector(n);
+  for (int i = 0; i < n; i++) setIdx(v, i, newEphemeron(0, 0));
+  return v;
+}
+obj newEphemeronTable() {
+  return slotlessObject(oEphemeronTable, ephemerons(EPHEMERON_TABLE_CAPACITY));
+}
+vector ephemeronEntry(obj table, obj key) {
+  vector entries = hiddenEntity(table);
+  for (int i = 0; i < vectorLength(entries); i++) if (idx(idx(entries, i), 0) == key) return idx(entries, i);
+  return NULL;
+}
+void ephemeronTablePut(obj table, obj key, obj value) {
+  vector e = ephemeronEntry(table, key);
+  if (!e && !(e = ephemeronEntry(table, NULL))) {
+    // Full: double the capacity.
+    vector entries = hiddenEntity(table), more = ephemerons(vectorLength(entries));
+    setHiddenData(table, vectorAppend(entries, more));
+    e = idx(more, 0);
+  }
+  setIdx(e, 0, key);
+  setIdx(e, 1, value);
+}
+
+// The collector's statistics as an object with a slot for each. Fragmentation is the percentage of the free
+// space left by the last full collection that lies outside of its largest segment.
+obj garbageCollectorStatisticsObject() {
+  gcStatistics s = garbageCollectorStatistics();
+  obj o = slotlessObject(oObject, emptyVector), byType = slotlessObject(oObject, emptyVector);
+  addCanonSlot(o, sFullCollections, integer(s.fullCollections));
+  addCanonSlot(o, sMinorCollections, integer(s.minorCollections));
+  addCanonSlot(o, sIncrementalCycles, integer(s.incrementalCycles));
+  addCanonSlot(o, sCompactions, integer(s.compactions));
+  addCanonSlot(o, sPauseNanoseconds, integer(s.pauseNanoseconds));
+  addCanonSlot(o, sLongestPauseNanoseconds, integer(s.longestPauseNanoseconds));
+  addCanonSlot(o, sCellsAllotted, integer(s.cellsAllotted));
+  addCanonSlot(o, sLiveCells, integer(s.liveCells));
+  addCanonSlot(o, sFreeCells, integer(s.freeCells));
+  addCanonSlot(o, sLargeCells, integer(s.largeCells));
+  addCanonSlot(o, sCellsReleased, integer(s.cellsReleased));
+  addCanonSlot(o, sFragmentation, integer(s.freeCells ? 100 - s.largestFreeSegment * 100 / s.freeCells : 0));
+  for (int i = 0; i < VECTOR_TYPES; i++)
+    addCanonSlot(byType, symbol(vectorTypeNames[i]), integer(s.liveVectors[i]));
+  addCanonSlot(o, sLiveVectors, byType);
+  return o;
+}
+
+// The allocation profiler charges each sample to a site: the selector of the current continuation, and the
+// prototype of its target. Each sample stands for profileInterval cells allotted there. Prototypes named from
+// C go by the name of their global, and the rest by their address.
+#define PROFILE_BUCKETS 1024
+
+typedef struct profileSite {
+  struct profileSite *next;
+  long samples;
+  char name[];
+} profileSite;
+
+profileSite *profileSites[PROFILE_BUCKETS];
+int profileSiteCount = 0, profileInterval = 0;
+volatile int profileLock = 0;
+
+// Called from the allocator, so it mustn't allot anything, or wait for the target.
+void sampleAllocation() {
+  continuation c = threadContinuation(currentThread);
+  char name[256], proto[32];
+  const char *s = "-", *p = "-";
+  if (c && vectorLength(c) == 9) { // Not the stand-in that a thread starts out with.
+    if (selector(c) && isSymbol(selector(c))) s = stringData(selector(c));
+    obj t = evaluated(c) && vectorLength(evaluated(c)) ? idx(evaluated(c), 0) : NULL;
+    if (t && isPromise(t)) p = "promise";
+    else if (t && vectorLength(t) == 4 && !(p = globalName(idx(t, 0)))) {
+      snprintf(proto, sizeof(proto), "%p", (void *)idx(t, 0));
+      p = proto;
+    }
+  }
+  snprintf(name, sizeof(name), "%s %s", s, p);
+  unsigned hash = 0;
+  for (char *n = name; *n; n++) hash = hash * 31 + *n;
+  while (__sync_lock_test_and_set(&profileLock, -1)) sched_yield();
+  profileSite **link = &profileSites[hash % PROFILE_BUCKETS];
+  while (*link && strcmp((*link)->name, name)) link = &(*link)->next;
+  if (!*link) {
+    if (!(*link = calloc(1, sizeof(profileSite) + strlen(name) + 1))) die("Could not record an allocation site.");
+    strcpy((*link)->name, name);
+    profileSiteCount++;
+  }
+  (*link)->samples++;
+  __sync_lock_release(&profileLock);
+}
+// Start sampling every "interval" cells, forgetting any earlier samples, or stop, given zero.
+void profileAllocations(int interval) {
+  sampleAllocations(0, NULL);
+  if (!interval) return;
+  while (__sync_lock_test_and_set(&profileLock, -1)) sched_yield();
+  for (int i = 0; i < PROFILE_BUCKETS; i++)
+    for (profileSite *s = profileSites[i], *next; s; s = next) {
+      next = s->next;
+      free(s);
+    }
+  memset(profileSites, 0, sizeof(profileSites));
+  profileSiteCount = 0;
+  profileInterval = interval;
+  __sync_lock_release(&profileLock);
+  sampleAllocations(interval, sampleAllocation);
+}
+// One line for each site, busiest first:
+//   site <selector> <prototype> <samples> <bytes>
+void writeAllocationProfile(FILE *f) {
+  while (__sync_lock_test_and_set(&profileLock, -1)) sched_yield();
+  profileSite *sites[profileSiteCount + 1];
+  int n = 0;
+  for (int i = 0; i < PROFILE_BUCKETS; i++)
+    for (profileSite *s = profileSites[i]; s; s = s->next) sites[n++] = s;
+  int compare(const void *a, const void *b) {
+    long x = (*(profileSite **)a)->samples, y = (*(profileSite **)b)->samples;
+    return x < y ? 1 : x > y ? -1 : 0;
+  }
+  qsort(sites, n, sizeof(profileSite *), compare);
+  for (int i = 0; i < n; i++)
+    fprintf(f, "site %s %ld %ld\n", sites[i]->name, sites[i]->samples,
+            sites[i]->samples * profileInterval * (long)sizeof(atom));
+  __sync_lock_release(&profileLock);
+}
+
 // This should never be called, as no primitive object should ever actually be sent a message.
 void prototypePrimitiveHiddenValue() {
   die("The prototype primitive's code was executed.");
@@ -454,6 +770,7 @@ void setupInterpreter() {
   initializeHeap();
   initializeMainThread();
   setCurrentThread(garbageCollectorRoot = createGarbageCollectorRoot(oNave));
+  initializeShapes();
   initializeObjects();
   initializePrototypeTags();
   intern(oSymbol);
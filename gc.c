@@ -16,11 +16,14 @@
     along with Gospel.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE // For pthread_getattr_np().
+
 #include <string.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 
 #include "gc.h"
 #include "death.h"
@@ -28,20 +31,51 @@
 #include "objects.h" // Because we define some object creation functions.
 
 #include <pthread.h>
+#include <sched.h>
 #include <setjmp.h>
 
 #include <gmp.h> // For bignum finalization.
-#include <regex.h> // For regex finalization.
 
-void *heap;
+#include <sys/mman.h> // For mapping in arenas.
+#include <time.h> // For timing pauses.
+#include <signal.h> // For "sig_atomic_t".
+
+// The heap starts out as a single arena of HEAP_CELLS cells. When a collection leaves more than
+// HEAP_GROWTH_THRESHOLD percent of the heap occupied, another arena of HEAP_GROWTH_PERCENT percent of the
+// current heap size is mapped in, until the heap reaches MAX_HEAP_CELLS. All of these can be overridden
+// at compile time, to trade memory for fewer collections.
+#ifndef HEAP_CELLS
+  #define HEAP_CELLS (1024 * 1024)
+#endif
+#ifndef MAX_HEAP_CELLS
+  #define MAX_HEAP_CELLS (64 * 1024 * 1024)
+#endif
+#ifndef HEAP_GROWTH_THRESHOLD
+  #define HEAP_GROWTH_THRESHOLD 75
+#endif
+#ifndef HEAP_GROWTH_PERCENT
+  #define HEAP_GROWTH_PERCENT 100
+#endif
 
-int liveSegmentCount = 0;
+typedef struct arenaStruct {
+  struct arenaStruct *next;
+  vector bottom, top; // The arena's first cell, and the address just past its last.
+  atom *marks,        // One mark bit for each cell, so that marking never has to touch the vectors,
+       *remembered;   // and another for each vector in the remembered set (see remember()).
+  int forwarding;     // Where the arena's entries in the forwarding table start, while compacting.
+} *arena;
 
-#define ARENA_CELLS (1024 * 1024)
+arena firstArena, lastArena;
+int heapCells = 0;
+long largeCells = 0; // In the large vector space, which also counts towards MAX_HEAP_CELLS.
+
+int liveSegmentCount = 0, freeCellCount = 0;
 
 #define TYPE_BIT_MASK 15
-// "Tag bits" are the type bits plus the GC mark bit.
-#define TAG_BIT_MASK  (TYPE_BIT_MASK * 2 + 1)
+// Set in the type words of vectors in the large vector space (see allotLarge()).
+#define LARGE_VECTOR_BIT 16
+// The "tag bits" below the length in the type word: the type and the large vector bit. The mark bits are
+// kept in a bitmap for each arena.
 #define TAG_BIT_COUNT 5
 
 
@@ -56,21 +90,57 @@ int liveSegmentCount = 0;
 #define ENVIRONMENT    8
 #define BIGNUM         9
 #define REGEX         10
-#define MARK_BIT      16
+// The referent of a weak reference, and the key of an ephemeron, don't keep it alive (see markEphemerons()).
+#define WEAK_REFERENCE 11
+#define EPHEMERON      12
+#define SHAPE          13
+
+const char *vectorTypeNames[VECTOR_TYPES] = {"atomVector", "entityVector", "promise", "actor", "primitive",
+                                             "method", "stackFrame", "vector", "environment", "integer", "regex",
+                                             "weakReference", "ephemeron", "shape"};
 
 // This provides eden space during startup, before the first real thread data object has been created.
-struct vectorStruct dummyThreadData = {0,
-                                       0,
-                                       5 << TAG_BIT_COUNT | MARK_BIT | ENTITY_VECTOR,
-                                       {0, 0, 0, 0, 0}};
+struct vectorStruct dummyThreadData = {5 << TAG_BIT_COUNT | ENTITY_VECTOR, {0, 0, 0, 0, 0}};
                                        
 typedef vector continuation;
 
+// Each interpreter thread bump-allocates out of a private buffer carved from the white list, so that the
+// common case of an allocation needs no shared lock. The unused remainder of a buffer is always kept
+// formatted as an unmarked vector, so that sweep() can walk over it like any other garbage.
+typedef struct {
+  vector remainder; // NULL when the buffer is exhausted.
+  int epoch,        // The value of collectionEpoch when the buffer was carved out.
+      untilSample;  // Cells left to allot before the allocation sampler is next called.
+} allocationBuffer;
+
+vector newAllocationBuffer(void);
+
+// The extent of a thread's stack, published while the thread is parked so that the compactor can find the
+// vectors that its C code refers to.
+typedef struct {
+  volatile int parked;
+  atom *top, *bottom; // The bottom is the end the stack grows from, and is looked up when first needed.
+} threadStack;
+
+vector newThreadStack(void);
+
+// The vectors that a thread has allotted since it last called invalidateEden(), which may be referred to
+// only from its C stack. They're marked as roots, and cleared down to the floor all at once. The floor is
+// raised while a nested call is evaluated, so that its doNext() doesn't clear the caller's temporaries.
+#define EDEN_ROOTS 256
+
+typedef struct {
+  int count, floor;
+  vector roots[EDEN_ROOTS];
+} edenRoots;
+
+vector newEdenRoots(void);
+
 vector newThreadData(vector cc,
                      vector prev,
                      vector next,
                      vector scratch) {
-  return newVector(5, cc, prev, next, scratch, 0);
+  return newVector(8, cc, prev, next, scratch, 0, newAllocationBuffer(), newThreadStack(), newEdenRoots());
 }
 
 continuation threadContinuation(vector td) { return idx(td, 0); }
@@ -79,6 +149,19 @@ vector       nextThreadData(vector td)     { return idx(td, 2); }
 vector       shelteredValue(vector td)     { return idx(td, 3); }
 vector       currentActor(vector td)       { return idx(td, 4); }
 
+// Threads without a buffer (the dummy thread data used during startup, and primitive threads that never
+// got thread data of their own) fall back to allocating under the GC lock.
+allocationBuffer *threadAllocationBuffer(vector td) {
+  return vectorLength(td) > 5 ? vectorData(idx(td, 5)) : NULL;
+}
+threadStack *threadStackOf(vector td) {
+  return vectorLength(td) > 6 ? vectorData(idx(td, 6)) : NULL;
+}
+// As above, such threads fall back to linking each new vector onto their sheltered value.
+edenRoots *threadEdenRoots(vector td) {
+  return vectorLength(td) > 7 ? vectorData(idx(td, 7)) : NULL;
+}
+
 vector setContinuation(continuation c) {
   setIdx(currentThread, 0, c);
   return currentThread;
@@ -90,19 +173,36 @@ vector setCurrentActor(vector td, vector a)         { return setIdx(td, 4, a);
 
 vector createGarbageCollectorRoot(obj rootLiveObject) {
   vector root = newThreadData(rootLiveObject, 0, 0, 0);
-  mark(setNextThreadData(root, setPreviousThreadData(root, root)));
-  return root;
+  return setNextThreadData(root, setPreviousThreadData(root, root));
 }
 
 vector addThread(vector root) {
+  // Allocate before taking the lock: a collection triggered from inside it would need the thread list.
+  vector new = newThreadData(0, 0, 0, 0);
   acquireThreadListLock();
-  vector next = nextThreadData(root),
-         new = newThreadData(0, root, next, 0);
+  vector next = nextThreadData(root);
+  setPreviousThreadData(new, root);
+  setNextThreadData(new, next);
   setNextThreadData(root, setPreviousThreadData(next, new));
   releaseThreadListLock();
   return new;
 }
 
+void forEachThreadData(void (*f)(vector)) {
+  if (!garbageCollectorRoot) return; // Still starting up, only the dummy thread data exists.
+  acquireThreadListLock();
+  vector td = garbageCollectorRoot;
+  do f(td); while ((td = nextThreadData(td)) != garbageCollectorRoot);
+  releaseThreadListLock();
+}
+void forEachAllocationBuffer(void (*f)(allocationBuffer *)) {
+  void each(vector td) {
+    allocationBuffer *ab = threadAllocationBuffer(td);
+    if (ab) f(ab);
+  }
+  forEachThreadData(each);
+}
+
 void killThreadData(vector td) {
   // Remove td from the doubly-linked list of live threadData objects.
   acquireThreadListLock();
@@ -136,7 +236,8 @@ void killThreadData(vector td) {
   }
 #endif
 
-vector blackList, grayList, ecruList, whiteList, emptyVector, garbageCollectorRoot;
+vector emptyVector, garbageCollectorRoot;
+vector emptySlots; // Shared by every slotless object. It has no room, so it's never written to.
 
 int vectorLength(vector v) {
   return v->type >> TAG_BIT_COUNT;
@@ -148,7 +249,7 @@ vector endOfEmptyVector(vector v) {
   return (vector)v->data;
 }
 void setVectorLength(vector v, int l) {
-  v->type = l << TAG_BIT_COUNT | v->type & TAG_BIT_MASK;
+  v->type = l << TAG_BIT_COUNT | v->type & (1 << TAG_BIT_COUNT) - 1;
 }
 
 int vectorType(vector v) {
@@ -169,6 +270,17 @@ int isEnvironment(obj o)  { return vectorType(o) == ENVIRONMENT; }
 int isInteger(obj o)      { return vectorType(o) == BIGNUM;      }
 int isRegex(obj o)        { return vectorType(o) == REGEX;       }
 
+int isWeakReference(obj o) {
+  vector v = hiddenEntity(o);
+  return vectorType(o) == ENTITY_VECTOR && v && vectorType(v) == WEAK_REFERENCE;
+}
+// An ephemeron table's hidden vector is filled with ephemerons, the unused ones without a key.
+int isEphemeronTable(obj o) {
+  vector v = hiddenEntity(o);
+  return vectorType(o) == ENTITY_VECTOR && v && vectorType(v) == ENTITY_VECTOR && vectorLength(v)
+         && idx(v, 0) && vectorType(idx(v, 0)) == EPHEMERON;
+}
+
 // As long as we admit as "strings" only NUL-terminated atom vectors, we won't segfault.
 int isString(obj o) {
   if (vectorType(o) == ENTITY_VECTOR) {
@@ -187,10 +299,13 @@ int isSymbol(obj o) {
 __mpz_struct *bignumData(obj o) {
   return vectorData(hiddenEntity(o));
 }
+void clearBignum(vector v) {
+  mpz_clear(vectorData(v));
+}
 vector emptyBignumVector() {
   vector v = makeAtomVector(CELLS_REQUIRED_FOR_BYTES(sizeof(__mpz_struct)));
   mpz_init((__mpz_struct *)vectorData(v));
-  return v;
+  return registerFinalizer(v, clearBignum);
 }
 obj emptyBignum() {
   return typedObject(oInteger, emptyBignumVector());
@@ -202,7 +317,7 @@ obj stringFromVector(vector v) {
 obj string(const char *s) {
   int length = CELLS_REQUIRED_FOR_BYTES(strlen(s) + 1);
   vector v = makeAtomVector(length);
-  strcpy((char *)vectorData(v), s); // TODO: Write barrier.
+  strcpy((char *)vectorData(v), s);
   return stringFromVector(v);
 }
 char *stringData(obj s) {
@@ -222,203 +337,1498 @@ int stringLength(obj s) {
 char stringIdx(obj s, int i) {
   return stringData(s)[i];
 }
-// TODO: Write barrier.
 void setStringIdx(obj s, int i, char c) {
   stringData(s)[i] = c;
 }
 
+#define ATOM_BITS (sizeof(atom) * 8)
+
+// Arenas are mapped in on ARENA_GRAIN_BITS boundaries, and a table indexed by address gives the arena that
+// covers each grain, so that finding a vector's arena never walks the list of them. The table has two levels,
+// and only the parts of it that cover the heap are allotted. A grain is only ever covered by one arena, but
+// may also hold a large vector's arena (or anything else) past that arena's top.
+#define ARENA_GRAIN_BITS 20
+#define ARENA_GRAIN ((atom)1 << ARENA_GRAIN_BITS)
+#define LOW_TABLE_BITS 12
+#define HIGH_TABLE_BITS (48 - LOW_TABLE_BITS - ARENA_GRAIN_BITS) // Enough for any user space address.
+
+arena *arenaTable[1 << HIGH_TABLE_BITS];
+
+#define LOW_TABLE_INDEX(grain) ((grain) & (1 << LOW_TABLE_BITS) - 1)
+
+arena **lowArenaTable(atom grain) {
+  return &arenaTable[grain >> LOW_TABLE_BITS & (1 << HIGH_TABLE_BITS) - 1];
+}
+arena arenaCovering(void *p) {
+  atom grain = (atom)p >> ARENA_GRAIN_BITS;
+  arena *low = *lowArenaTable(grain);
+  return low ? low[LOW_TABLE_INDEX(grain)] : NULL;
+}
+// Point the table entries for the grains that "a" covers at "entry", which is either "a" or NULL once the
+// arena is unmapped. Return false if there's no memory for the table.
+int setArenaTableEntries(arena a, arena entry) {
+  for (atom grain = (atom)a >> ARENA_GRAIN_BITS; grain <= ((atom)a->top - 1) >> ARENA_GRAIN_BITS; grain++) {
+    arena **low = lowArenaTable(grain);
+    if (!*low && !(*low = calloc(1 << LOW_TABLE_BITS, sizeof(arena)))) return 0;
+    (*low)[LOW_TABLE_INDEX(grain)] = entry;
+  }
+  return -1;
+}
+
+arena largeArenaOf(vector);
+arena arenaOf(vector v) {
+  arena a = arenaCovering(v);
+  if (a && v >= a->bottom && v < a->top) return a;
+  return v->type & LARGE_VECTOR_BIT ? largeArenaOf(v) : NULL;
+}
+// Find the word of one of the arena's bitmaps that holds the bit for "v", and the bit itself.
+atom *bitIn(arena a, atom *bitmap, vector v, atom *bit) {
+  unsigned cell = (atom *)v - (atom *)a->bottom;
+  *bit = (atom)1 << cell % ATOM_BITS;
+  return &bitmap[cell / ATOM_BITS];
+}
+atom *markWordIn(arena a, vector v, atom *bit) {
+  return bitIn(a, a->marks, v, bit);
+}
+// A vector outside of the heap (like dummyThreadData) has no mark bit, and counts as marked so that it's
+// never scanned.
+atom *markWord(vector v, atom *bit) {
+  arena a = arenaOf(v);
+  return a ? markWordIn(a, v, bit) : NULL;
+}
 // Used only during a garbage collection cycle.
 int isMarked(vector v) {
-  return v->type & MARK_BIT;
+  atom bit, *word = markWord(v, &bit);
+  return !word || *word & bit;
 }
-void setMarkBit(vector v) {
-  v->type |= MARK_BIT;
+// Neighbouring vectors share a word, so the bits are always changed atomically. Return whether the bit was
+// already set.
+int setMarkBit(vector v) {
+  atom bit, *word = markWord(v, &bit);
+  return !word || *word & bit || __sync_fetch_and_or(word, bit) & bit;
 }
 void clearMarkBit(vector v) {
-  v->type &= ~MARK_BIT;
+  atom bit, *word = markWord(v, &bit);
+  if (word) __sync_fetch_and_and(word, ~bit);
 }
 
-vector replace(vector v, vector replacement) {
-  if (v == v->next) return replacement->prev = replacement->next = replacement;
-  replacement->prev = v->prev;
-  replacement->next = v->next;
-  v->prev->next = v->next->prev = replacement;
-  return replacement;
+#define VECTOR_HEADER_SIZE 1
+#include <stdio.h>
+// White segments are kept in size classes, each a list: one for each of the short lengths that are allotted
+// most often, and above those, eight for each power of two, splitting it evenly. A bitmap of the classes that
+// have any segments finds the first one able to satisfy a request without searching. A segment keeps its link
+// in its own cells, so segments of length 0 have no room for one: they're left where they are, to be merged
+// with their neighbours by the next sweep.
+#define EXACT_CLASS_BITS 6 // Lengths 0 to 63 have classes of their own.
+#define EXACT_CLASSES (1 << EXACT_CLASS_BITS)
+#define SUBCLASS_BITS 3
+#define WHITE_CLASSES (EXACT_CLASSES + (31 - EXACT_CLASS_BITS << SUBCLASS_BITS))
+#define CLASS_MAP_WORDS ((WHITE_CLASSES + ATOM_BITS - 1) / ATOM_BITS)
+
+vector whiteLists[WHITE_CLASSES];
+uintptr_t whiteClassMap[CLASS_MAP_WORDS];
+
+vector *whiteNext(vector v) { return (vector *)&v->data[0]; }
+
+int whiteClass(int n) {
+  if (n < EXACT_CLASSES) return n;
+  int log = 31 - __builtin_clz(n), subclass = n >> log - SUBCLASS_BITS & (1 << SUBCLASS_BITS) - 1;
+  return EXACT_CLASSES + (log - EXACT_CLASS_BITS << SUBCLASS_BITS) + subclass;
 }
-vector insertBetween(vector v, vector prev, vector next) {
-  return v == prev || v == next ? v : ((v->next = next)->prev = (v->prev = prev)->next = v);
+// The shortest length in the class.
+int whiteClassBase(int c) {
+  if (c < EXACT_CLASSES) return c;
+  int log = EXACT_CLASS_BITS + (c - EXACT_CLASSES >> SUBCLASS_BITS);
+  return 1 << log | (c - EXACT_CLASSES & (1 << SUBCLASS_BITS) - 1) << log - SUBCLASS_BITS;
 }
-vector insertBefore(vector v, vector next) {
-  return insertBetween(v, next->prev, next);
+// The first class whose segments all have room for n cells.
+int firstClassHolding(int n) {
+  int c = whiteClass(n);
+  return whiteClassBase(c) < n ? c + 1 : c;
 }
-vector extract(vector v) {
-  v->prev->next = v->next;
-  v->next->prev = v->prev;
+
+void clearWhiteSegments() {
+  memset(whiteLists, 0, sizeof(whiteLists));
+  memset(whiteClassMap, 0, sizeof(whiteClassMap));
+}
+
+extern volatile int marking;
+
+void addWhiteSegment(vector v) {
+  int n = vectorLength(v);
+  if (!n) return;
+  // Outside of a cycle, a mark bit keeps a minor collection from sweeping the segment up a second time. In a
+  // cycle, it would keep the sweep from taking it back when the white list is rebuilt.
+  if (!marking) setMarkBit(v);
+  int c = whiteClass(n);
+  *whiteNext(v) = whiteLists[c];
+  whiteLists[c] = v;
+  whiteClassMap[c / ATOM_BITS] |= (uintptr_t)1 << c % ATOM_BITS;
+}
+
+// The sweeps and the compactor give the pages inside each white segment of at least RELEASE_CELLS cells back
+// to the system, keeping the ones that hold the segment's header and link. They're mapped in again, zeroed,
+// when next touched. A segment that is still white at the next sweep has its pages released (and counted)
+// again, but by then they cost only the system call. Zero disables this.
+#ifndef RELEASE_CELLS
+  #define RELEASE_CELLS (64 * 1024)
+#endif
+
+void releasePages(vector white) {
+  static long pageSize = 0;
+  if (!RELEASE_CELLS || vectorLength(white) < RELEASE_CELLS) return;
+  if (!pageSize) pageSize = sysconf(_SC_PAGESIZE);
+  atom start = (atom)(whiteNext(white) + 1), end = (atom)endOfVector(white);
+  start = (start + pageSize - 1) & -pageSize;
+  end &= -pageSize;
+  if (start < end && !madvise((void *)start, end - start, MADV_DONTNEED))
+    gcStats.cellsReleased += (end - start) / sizeof(atom);
+}
+
+vector takeFromClass(int c) {
+  vector v = whiteLists[c];
+  if (!(whiteLists[c] = *whiteNext(v))) whiteClassMap[c / ATOM_BITS] &= ~((uintptr_t)1 << c % ATOM_BITS);
   return v;
 }
+// The first class from c on with any segments, or -1.
+int nonemptyClassFrom(int c) {
+  for (int w = c / ATOM_BITS, shift = c % ATOM_BITS; w < CLASS_MAP_WORDS; w++, shift = 0) {
+    uintptr_t bits = whiteClassMap[w] >> shift << shift;
+    if (bits) return w * ATOM_BITS + __builtin_ctzl(bits);
+  }
+  return -1;
+}
+
+// Remove and return a white segment of exactly "size" cells, if the first in its class is one, or failing that
+// one from the first class with room to split off the excess as a segment of its own.
+vector takeWhiteSegment(int size) {
+  int c = whiteClass(size);
+  if (whiteLists[c] && vectorLength(whiteLists[c]) == size) return takeFromClass(c);
+  c = nonemptyClassFrom(firstClassHolding(size + VECTOR_HEADER_SIZE));
+  return c < 0 ? 0 : takeFromClass(c);
+}
+// Remove and return a segment of the largest class, as long as it has room for "size" cells.
+vector takeLargestWhiteSegment(int size) {
+  for (int w = CLASS_MAP_WORDS; w--;)
+    if (whiteClassMap[w]) {
+      int c = w * ATOM_BITS + ATOM_BITS - 1 - __builtin_clzl(whiteClassMap[w]);
+      return vectorLength(whiteLists[c]) >= size ? takeFromClass(c) : 0;
+    }
+  return 0;
+}
 
-#define VECTOR_HEADER_SIZE 3
-#include <stdio.h>
-vector constructWhiteList() {
-  const vector topOfHeap = (vector)(heap + ARENA_CELLS * sizeof(atom));
-  struct vectorStruct stub = {0, 0, 0};
-  vector prev = &stub,
-         current = endOfEmptyVector(emptyVector); // The real beginning of the heap.
+void forEachWhiteSegment(void (*f)(vector)) {
+  for (int c = 0; c < WHITE_CLASSES; c++)
+    for (vector v = whiteLists[c]; v; v = *whiteNext(v)) f(v);
+}
+
+size_t bitmapSize(int cells) {
+  return (cells / ATOM_BITS + 1) * sizeof(atom);
+}
+// The bytes mapped in for an arena of "cells" cells: its header, then its two bitmaps, then the cells.
+size_t arenaSize(int cells) {
+  return sizeof(struct arenaStruct) + 2 * bitmapSize(cells) + cells * sizeof(atom);
+}
+// Map in an arena with room for "cells" cells, or return NULL if the system won't give us one.
+// Back the arenas with transparent huge pages, where the system has them. Releasing pages from a white
+// segment splits any huge page that it falls in.
+#ifndef HUGE_PAGES
+  #define HUGE_PAGES 0
+#endif
+
+// A grain more than is needed is mapped in, and what lies either side of the aligned arena is given back.
+arena mapArena(int cells) {
+  long pageSize = sysconf(_SC_PAGESIZE);
+  atom size = arenaSize(cells) + pageSize - 1 & -pageSize;
+  char *mapped = mmap(NULL, size + ARENA_GRAIN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapped == MAP_FAILED) return NULL;
+  arena a = (arena)((atom)mapped + ARENA_GRAIN - 1 & -ARENA_GRAIN);
+  if ((char *)a > mapped) munmap(mapped, (char *)a - mapped);
+  munmap((char *)a + size, mapped + ARENA_GRAIN - (char *)a);
+  #ifdef MADV_HUGEPAGE
+    if (HUGE_PAGES) madvise(a, arenaSize(cells), MADV_HUGEPAGE);
+  #endif
+  a->next = NULL;
+  a->marks = (atom *)(a + 1);
+  a->remembered = (atom *)((char *)a->marks + bitmapSize(cells));
+  a->bottom = (vector)((char *)a->remembered + bitmapSize(cells));
+  a->top = (vector)((atom *)a->bottom + cells);
+  if (!setArenaTableEntries(a, a)) {
+    munmap(a, size);
+    return NULL;
+  }
+  return a;
+}
+// The first vector of an arena. "emptyVector" sits at the bottom of the first arena, and isn't part of
+// the heap.
+vector arenaStart(arena a) {
+  return a == firstArena ? endOfEmptyVector(emptyVector) : a->bottom;
+}
+arena arenaContaining(void *p) {
+  arena a = arenaCovering(p);
+  return a && (vector)p >= arenaStart(a) && (vector)p < a->top ? a : NULL;
+}
+
+// Add an arena big enough for at least "cells" cells to the white list, following the growth policy.
+// Return false if that would take us past MAX_HEAP_CELLS, or if the memory isn't available.
+int growHeap(int cells) {
+  int growth = heapCells / 100 * HEAP_GROWTH_PERCENT;
+  if (growth < cells) growth = cells;
+  if (growth > MAX_HEAP_CELLS - heapCells - largeCells) growth = MAX_HEAP_CELLS - heapCells - largeCells;
+  if (growth > INT_MAX >> TAG_BIT_COUNT) growth = INT_MAX >> TAG_BIT_COUNT; // Must fit in one vector.
+  if (growth < cells || growth <= VECTOR_HEADER_SIZE) return 0;
+  arena a = mapArena(growth);
+  if (!a) return 0;
+  heapCells += growth;
+  lastArena = lastArena->next = a;
+  vector v = a->bottom;
+  v->type = growth - VECTOR_HEADER_SIZE << TAG_BIT_COUNT | ATOM_VECTOR;
+  addWhiteSegment(v);
+  return -1;
+}
+// If a collection left little free, grow now rather than collecting again almost straight away.
+void growIfCrowded() {
+  if (heapCells - freeCellCount > heapCells / 100 * HEAP_GROWTH_THRESHOLD) growHeap(0);
+}
+
+// Vectors of LARGE_VECTOR_CELLS cells or more are kept out of the heap, so that they don't fragment it and
+// aren't swept over a cell at a time. Each is mapped in as an arena of its own, whose bitmaps need only a
+// word each, and which is unmapped as soon as a collection finds it dead. The arenas are linked together
+// apart from the heap's, and a vector's large vector bit tells arenaOf() to find its arena just below it.
+#ifndef LARGE_VECTOR_CELLS
+  #define LARGE_VECTOR_CELLS (4 * 1024)
+#endif
+
+arena largeArenas = NULL;
+
+size_t largeArenaSize(int cells) {
+  return sizeof(struct arenaStruct) + (2 + cells) * sizeof(atom);
+}
+arena mapLargeArena(int cells) {
+  arena a = mmap(NULL, largeArenaSize(cells), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (a == MAP_FAILED) return NULL;
+  a->marks = (atom *)(a + 1);
+  a->remembered = a->marks + 1;
+  a->bottom = (vector)(a->remembered + 1);
+  a->top = (vector)((atom *)a->bottom + cells);
+  a->next = largeArenas;
+  largeCells += cells;
+  return largeArenas = a;
+}
+arena largeArenaOf(vector v) {
+  return (arena)((atom *)v - 2) - 1;
+}
+
+// Vectors that hold on to something from outside of the heap (a bignum's limbs, a compiled regex, a file
+// descriptor) are registered along with a function that releases it, so that the sweep never has to look at
+// what it frees. Once marking is over, the registered vectors left unmarked are finalized and forgotten, while
+// they're still intact. Entries below oldFinalizables are for vectors that have survived a collection, and a
+// minor collection only looks at the rest.
+typedef struct {
+  vector v;
+  void (*finalizer)(vector);
+} finalizable;
+
+finalizable *finalizables;
+int finalizableCount = 0, finalizableCapacity = 0, oldFinalizables = 0;
+volatile int finalizableLock = 0;
+
+void lockFinalizables() {
+  while (__sync_lock_test_and_set(&finalizableLock, -1)) sched_yield();
+}
+void unlockFinalizables() {
+  __sync_lock_release(&finalizableLock);
+}
+vector registerFinalizer(vector v, void (*f)(vector)) {
+  lockFinalizables();
+  if (finalizableCount == finalizableCapacity) {
+    finalizableCapacity = finalizableCapacity ? finalizableCapacity * 2 : 1024;
+    if (!(finalizables = realloc(finalizables, finalizableCapacity * sizeof(finalizable))))
+      die("Could not grow the finalization registry.");
+  }
+  finalizables[finalizableCount].v = v;
+  finalizables[finalizableCount++].finalizer = f;
+  unlockFinalizables();
+  return v;
+}
+// Finalize the unmarked vectors registered from "first" on. The rest are old from now on.
+void finalizeUnmarked(int first) {
+  lockFinalizables();
+  int kept = first;
+  for (int i = first; i < finalizableCount; i++)
+    if (isMarked(finalizables[i].v)) finalizables[kept++] = finalizables[i];
+    else finalizables[i].finalizer(finalizables[i].v);
+  oldFinalizables = finalizableCount = kept;
+  unlockFinalizables();
+}
+
+// After marking, the heap is swept lazily: the allocator sweeps another stretch of it each time it runs out
+// of white segments, and whatever is left is finished off before the next marking starts. Arenas mapped in
+// after marking are left alone, as their unmarked vectors aren't garbage.
+#ifndef SWEEP_CELLS
+  #define SWEEP_CELLS (64 * 1024)
+#endif
+
+gcStatistics gcStats;
+
+// Counted by the sweep or the compactor as they pass the survivors of a full collection, and published once
+// they're done.
+long liveCells, liveVectors[VECTOR_TYPES];
+
+void countLive(vector v) {
+  liveSegmentCount++;
+  liveCells += vectorLength(v) + VECTOR_HEADER_SIZE;
+  liveVectors[vectorType(v)]++;
+}
+void publishLiveCounts(int largestFreeSegment) {
+  gcStats.liveCells = liveCells;
+  gcStats.freeCells = freeCellCount;
+  gcStats.largestFreeSegment = largestFreeSegment;
+  memcpy(gcStats.liveVectors, liveVectors, sizeof(liveVectors));
+  liveCells = 0;
+  memset(liveVectors, 0, sizeof(liveVectors));
+}
+
+arena sweepArena = NULL, // NULL unless a sweep is under way.
+      sweepLastArena;
+vector sweepCursor;
+int largestWhiteSegment;
+
+// When a sweep leaves the free space so fragmented that its largest segment holds less than
+// 100 - COMPACTION_THRESHOLD percent of it, the next collection compacts the heap instead of sweeping it.
+// Zero disables compaction.
+#ifndef COMPACTION_THRESHOLD
+  #define COMPACTION_THRESHOLD 90
+#endif
+int compactionWanted = 0;
+
+void startSweeping() {
+  sweepArena = firstArena;
+  sweepLastArena = lastArena;
+  sweepCursor = arenaStart(firstArena);
+  clearWhiteSegments();
+  liveSegmentCount = freeCellCount = largestWhiteSegment = 0;
+}
+
+// Sweep on until at least "cells" cells have been covered and return the number actually covered,
+// which is zero once there's nothing left to sweep.
+int sweep(int cells) {
+  int swept = 0;
   void advance() {
-    current = endOfVector(current);
+    sweepCursor = endOfVector(sweepCursor);
   }
-  vector finish() {
-    if (prev == emptyVector) {
-      // TODO: This is very unlikely, can we make it impossible and eliminate this logic?
-      die("<nothing free after garbage collection>");
-    }
-    vector first = stub.next;
-    first->prev = prev;
-    prev->next = first;
-    return first;
-  }
-  auto vector coalesce(void);
-  vector sweep() {
-    liveSegmentCount++;
-    clearMarkBit(current);
-    advance();
-    return current == topOfHeap ? finish()
-         : !isMarked(current)   ? coalesce()
-         :                        sweep();
-  }
-  vector coalesce() {
-    vector base = current;
-    void merge() {
-      // Combine contiguous white segments and link the result to the previous white segment.
-      setVectorLength(base, ((int)current - (int)base->data) / sizeof(atom));
-      base->prev = prev;
-      prev = prev->next = base;
+  int marked(vector v) {
+    atom bit, *word = markWordIn(sweepArena, v, &bit);
+    return (*word & bit) != 0;
+  }
+  void finish() {
+    sweepArena = NULL;
+    publishLiveCounts(largestWhiteSegment);
+    if (COMPACTION_THRESHOLD && largestWhiteSegment < freeCellCount / 100 * (100 - COMPACTION_THRESHOLD))
+      compactionWanted = -1;
+    growIfCrowded();
+  }
+  while (sweepArena && swept < cells) {
+    if (sweepCursor == sweepArena->top) {
+      // White segments can't span the gap between two arenas, so each arena is swept separately.
+      if (sweepArena == sweepLastArena) finish();
+      else sweepCursor = (sweepArena = sweepArena->next)->bottom;
+      continue;
     }
-    for (;;) {
-      switch (vectorType(current)) { // Perform finalization for the primitive types that need it.
-        case BIGNUM:
-          mpz_clear(bignumData(current));
-          setVectorType(current, ENTITY_VECTOR);
-          break;
-        case REGEX:
-          regfree(vectorData(hiddenEntity(current)));
-          setVectorType(current, ENTITY_VECTOR);
-      }
+    vector base = sweepCursor;
+    if (marked(base)) { // Survivors keep their mark bits: they're old now.
+      countLive(base);
       advance();
-      if (current == topOfHeap) {
-        merge();
-        return finish();
-      }
-      if (isMarked(current)) {
-        merge();
-        return sweep();
-      }
     }
+    else {
+      // Combine contiguous white segments into one.
+      do advance(); while (sweepCursor != sweepArena->top && !marked(sweepCursor));
+      setVectorLength(base, (atom *)sweepCursor - (atom *)base->data);
+      freeCellCount += vectorLength(base) + VECTOR_HEADER_SIZE;
+      if (vectorLength(base) > largestWhiteSegment) largestWhiteSegment = vectorLength(base);
+      addWhiteSegment(base);
+      releasePages(base);
+    }
+    swept += (atom *)sweepCursor - (atom *)base;
   }
-
-  liveSegmentCount = 0;
-  return isMarked(current) ? sweep() : coalesce();
+  return swept;
+}
+void finishSweeping() {
+  int swept;
+  while ((swept = sweep(INT_MAX))) gcStats.cellsSweptInPause += swept;
 }
 
-// Return the number of cells occupied by the segments of the white list, including headers.
+// Incremented by every collection, invalidating all the allocation buffers carved out before it.
+int collectionEpoch = 0;
+// The interpreter's inline caches only remember lookups through old objects, which are seldom changed and
+// outlive minor collections, so it's only changes to those, and full collections, that invalidate them.
+volatile atom lookupEpoch = 1;
+// Set while a collector is waiting for the other threads to reach a safepoint, and until it's done.
+volatile int collectionPending = 0;
+
+// Return the number of cells occupied by the segments of the white list and the unused parts of the
+// allocation buffers, including headers.
 // Should only be called from inside the allocator lock, to avoid the possibility of a GC interrupting.
 int freeSpaceCount() {
   int result = 0;
-  vector current = whiteList;
-  do {
-    result += vectorLength(current) + VECTOR_HEADER_SIZE;
-  } while ((current = current->next) != whiteList);
-  return result;
-}
-
-void mark(vector v) {
-  if (v && !isMarked(v)) {
-    setMarkBit(v);
-    insertBefore(v, blackList);
+  finishSweeping();
+  void countSegment(vector v) {
+    result += vectorLength(v) + VECTOR_HEADER_SIZE;
   }
+  forEachWhiteSegment(countSegment);
+  void count(allocationBuffer *ab) {
+    if (ab->remainder && ab->epoch == collectionEpoch)
+      result += vectorLength(ab->remainder) + VECTOR_HEADER_SIZE;
+  }
+  forEachAllocationBuffer(count);
+  return result;
 }
 
 vector symbolTable;
-void flip() {
-  whiteList = constructWhiteList();
-  blackList = emptyVector;
-  blackList->next = blackList->prev = grayList = garbageCollectorRoot;
-  grayList->next = grayList->prev = blackList;
-  setMarkBit(emptyVector);
-  setMarkBit(garbageCollectorRoot);
-}
 
 // TODO: Rearrange so that this isn't necessary.
-void markPromise(vector);
-void markActor(vector);
+void noteWeak(vector);
+void tracePromise(vector, void (*)(vector));
+void traceActor(vector, void (*)(vector));
+void tracePromiseReferences(vector, void (*)(vector *));
+void traceActorReferences(vector, void (*)(vector *));
 
+// Apply f to each of the vectors that v refers to.
 // TODO: Now that e.g. primitives and integers have their own typetag values, they can be
 //       implemented more efficiently.
-void scan() {
-  switch (vectorType(grayList)) {
+void traceVector(vector v, void (*f)(vector)) {
+  switch (vectorType(v)) {
     case PROMISE:
-      markPromise(grayList);
+      tracePromise(v, f);
+      break;
+    case EPHEMERON:
+      if (idx(v, 0) && isMarked(idx(v, 0))) f(idx(v, 1)); // An unused ephemeron's missing key counts as dead.
+    case WEAK_REFERENCE:
+      noteWeak(v);
       break;
     case ACTOR:
-      markActor(grayList);
+      traceActor(v, f);
     case ATOM_VECTOR:
       break;
     default:
-      for (int i = 0; i < vectorLength(grayList); i++) mark(idx(grayList, i));
+      for (int i = 0; i < vectorLength(v); i++) f(idx(v, i));
       break;
     }
-  grayList = grayList->next;
 }
 
-#include <stdio.h>
-void collectGarbage() {
-  mark(garbageCollectorRoot); // FIXME: Redundant with respect to flip(), above?
-  mark(oNave); // FIXME: Redundant due to oNave being referenced from the root thread data object?
-  while (grayList != blackList) scan();
-  flip();
+// Like traceVector(), but f gets the address of each reference, so that it can update it.
+void traceReferences(vector v, void (*f)(vector *)) {
+  switch (vectorType(v)) {
+    case PROMISE:
+      tracePromiseReferences(v, f);
+      break;
+    case ACTOR:
+      traceActorReferences(v, f);
+    case ATOM_VECTOR:
+      break;
+    default:
+      for (int i = 0; i < vectorLength(v); i++) f(idxPointer(v, i));
+      break;
+    }
 }
 
-vector doAllotment(int size) {
-  vector firstWhiteSegment = whiteList;
+// The mark phase is shared out between the collecting thread and a pool of marker threads, each with a
+// gray stack of its own. A marker that runs out of work steals half of another's stack, and marking is
+// over once every marker is idle at the same time.
+#define MAX_MARKERS 16
+#ifndef MARKERS
+  #define MARKERS 0 // One per processor.
+#endif
+
+typedef struct {
+  volatile int lock;
+  vector *items;
+  int count, capacity;
+} grayStack;
+
+grayStack grayStacks[MAX_MARKERS];
+int markerCount = 0;
+volatile int idleMarkers;
+
+void lockGrayStack(grayStack *s) {
+  while (__sync_lock_test_and_set(&s->lock, -1)) sched_yield();
+}
+void unlockGrayStack(grayStack *s) {
+  __sync_lock_release(&s->lock);
+}
+void pushGray(grayStack *s, vector v) {
+  lockGrayStack(s);
+  if (s->count == s->capacity) {
+    s->capacity = s->capacity ? s->capacity * 2 : 1024;
+    if (!(s->items = realloc(s->items, s->capacity * sizeof(vector)))) die("Could not grow a gray stack.");
+  }
+  s->items[s->count++] = v;
+  unlockGrayStack(s);
+}
+vector popGray(grayStack *s) {
+  lockGrayStack(s);
+  vector v = s->count ? s->items[--s->count] : 0;
+  unlockGrayStack(s);
+  return v;
+}
+// Move the older half of the victim's stack onto the thief's, which must be empty.
+int stealGray(grayStack *thief, grayStack *victim) {
+  if (!victim->count) return 0; // Only a hint, checked again below.
+  lockGrayStack(victim);
+  int n = (victim->count + 1) / 2;
+  if (n) {
+    lockGrayStack(thief);
+    if (thief->capacity < n) {
+      thief->capacity = n;
+      if (!(thief->items = realloc(thief->items, n * sizeof(vector)))) die("Could not grow a gray stack.");
+    }
+    memcpy(thief->items, victim->items, n * sizeof(vector));
+    thief->count = n;
+    unlockGrayStack(thief);
+    memmove(victim->items, victim->items + n, (victim->count -= n) * sizeof(vector));
+  }
+  unlockGrayStack(victim);
+  return n;
+}
+
+// The mark bit is set atomically, so that exactly one thread ends up responsible for each vector.
+void shadeOnto(grayStack *s, vector v) {
+  if (v && !setMarkBit(v)) pushGray(s, v);
+}
+
+// Gray vectors are popped into a little queue and prefetched, and only scanned once they reach the front of
+// it, by which time they should be in the cache.
+#ifndef PREFETCH_DISTANCE
+  #define PREFETCH_DISTANCE 8
+#endif
+
+void markFrom(grayStack *own) {
+  void shade(vector v) {
+    shadeOnto(own, v);
+  }
+  int steal() {
+    for (int i = 0; i < markerCount; i++) if (stealGray(own, &grayStacks[i])) return -1;
+    return 0;
+  }
+  int anyWork() {
+    for (int i = 0; i < markerCount; i++) if (grayStacks[i].count) return -1;
+    return 0;
+  }
+  vector queue[PREFETCH_DISTANCE];
+  int front = 0, queued = 0;
+  void drain() {
+    vector v;
+    for (;;)
+      if (queued < PREFETCH_DISTANCE && (v = popGray(own))) {
+        __builtin_prefetch(v);
+        queue[(front + queued++) % PREFETCH_DISTANCE] = v;
+      }
+      else if (queued) {
+        v = queue[front];
+        front = (front + 1) % PREFETCH_DISTANCE;
+        queued--;
+        traceVector(v, shade);
+      }
+      else return;
+  }
+  for (;;) {
+    drain();
+    if (steal()) continue;
+    __sync_fetch_and_add(&idleMarkers, 1);
+    for (;;) {
+      if (idleMarkers == markerCount) return;
+      if (anyWork()) break;
+      sched_yield();
+    }
+    __sync_fetch_and_sub(&idleMarkers, 1);
+  }
+}
+
+pthread_mutex_t markerLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t markersWanted = PTHREAD_COND_INITIALIZER,
+               markersFinished = PTHREAD_COND_INITIALIZER;
+int markingRound = 0, markersRunning = 0;
+
+void *markerThread(void *stack) {
+  for (int round = 0;;) {
+    pthread_mutex_lock(&markerLock);
+    while (markingRound == round) pthread_cond_wait(&markersWanted, &markerLock);
+    round = markingRound;
+    pthread_mutex_unlock(&markerLock);
+    markFrom(stack);
+    pthread_mutex_lock(&markerLock);
+    if (!--markersRunning) pthread_cond_signal(&markersFinished);
+    pthread_mutex_unlock(&markerLock);
+  }
+}
+void startMarkers() {
+  long processors = MARKERS ? MARKERS : sysconf(_SC_NPROCESSORS_ONLN);
+  markerCount = processors < 1 ? 1 : processors > MAX_MARKERS ? MAX_MARKERS : processors;
+  for (int i = 1; i < markerCount; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, markerThread, &grayStacks[i])) die("Failed spawning a marker thread.");
+    pthread_detach(thread);
+  }
+}
+
+// Mark everything reachable from the gray vectors, leaving the gray stacks empty.
+void markInParallel() {
+  if (!markerCount) startMarkers();
+  idleMarkers = 0;
+  pthread_mutex_lock(&markerLock);
+  markersRunning = markerCount - 1;
+  ++markingRound;
+  pthread_cond_broadcast(&markersWanted);
+  pthread_mutex_unlock(&markerLock);
+  markFrom(&grayStacks[0]);
+  pthread_mutex_lock(&markerLock);
+  while (markersRunning) pthread_cond_wait(&markersFinished, &markerLock);
+  pthread_mutex_unlock(&markerLock);
+}
+
+// Set while an incremental collection cycle is under way.
+volatile int marking = 0;
+
+// Between cycles, collection is generational. A vector whose mark bit is still set from the last collection
+// is old, and one allotted since is young. Once NURSERY_CELLS cells have been allotted, a minor collection
+// marks just the young vectors reachable from the roots and from the remembered set, and sweeps just the
+// parts of the heap allotted since the last collection. Survivors are promoted where they are, by keeping
+// their mark bits, and old vectors are only reclaimed by a full collection, which starts by clearing every
+// mark bit. Zero disables minor collections.
+#ifndef NURSERY_CELLS
+  #define NURSERY_CELLS (256 * 1024)
+#endif
+
+// The old vectors that have had a young one stored into them since the last collection, along with any young
+// vectors stored where writeBarrier() couldn't tell into what. A bit in the arena's "remembered" bitmap
+// keeps each from being added more than once.
+grayStack rememberedSet;
+
+void rememberIn(arena a, vector v) {
+  atom bit, *word = bitIn(a, a->remembered, v, &bit);
+  if (!(*word & bit) && !(__sync_fetch_and_or(word, bit) & bit)) pushGray(&rememberedSet, v);
+}
+void remember(vector v) {
+  arena a = arenaOf(v);
+  if (a) rememberIn(a, v);
+}
+// Remember "v" if it's old and "e", just stored into it, is young. Most stores are into young vectors, and
+// need only the one look at "v"'s mark bit. What's stored is usually from the same arena, whose bitmap can
+// then be read without looking it up again.
+void rememberIfOldToYoung(vector v, vector e) {
+  arena a = arenaOf(v);
+  atom bit, *word;
+  if (!a || !(*markWordIn(a, v, &bit) & bit)) return;
+  word = e >= a->bottom && e < a->top ? markWordIn(a, e, &bit) : markWord(e, &bit);
+  if (word && !(*word & bit)) rememberIn(a, v);
+}
+vector popRemembered() {
+  vector v = popGray(&rememberedSet);
+  if (v) {
+    arena a = arenaOf(v);
+    atom bit, *word = bitIn(a, a->remembered, v, &bit);
+    __sync_fetch_and_and(word, ~bit);
+  }
+  return v;
+}
+
+// While marking, anything stored into a vector that the collector may already have scanned must be shaded,
+// or it could be missed. Vectors allotted during a cycle start out black, so they are never scanned at all.
+// Atom vectors (string data, for instance) are never scanned either, so stores into them need no barrier.
+// Between cycles, the same barrier feeds the remembered set.
+void shade(vector v) {
+  shadeOnto(&grayStacks[0], v);
+}
+void *writeBarrier(void *e) {
+  if (marking) shade(e);
+  else if (NURSERY_CELLS && e && !isMarked(e)) remember(e);
+  return e;
+}
+// For vectors filled in by copying, rather than with setIdx(). A minor collection may already have promoted
+// the vector before it was filled.
+vector shadeReferences(vector v) {
+  if (marking) traceVector(v, shade);
+  else if (NURSERY_CELLS && isMarked(v)) remember(v);
+  return v;
+}
+
+void mark(vector v) {
+  shade(v);
+}
+
+// The weak references and ephemerons that have been traced since marking started. Once there's nothing left
+// to mark, the values of the ephemerons whose keys turned out to be reachable are marked in turn, which may
+// make more keys reachable, and so on. Then the rest are emptied, along with the weak references whose
+// referents weren't reached.
+grayStack weakVectors;
+
+vector newWeakReference(vector referent) {
+  vector v = makeVector(1);
+  setVectorType(v, WEAK_REFERENCE);
+  setIdx(v, 0, referent);
+  return v;
+}
+vector newEphemeron(vector key, vector value) {
+  vector v = makeVector(2);
+  setVectorType(v, EPHEMERON);
+  setIdx(v, 0, key);
+  setIdx(v, 1, value);
+  return v;
+}
+
+void noteWeak(vector v) {
+  pushGray(&weakVectors, v);
+}
+void markEphemerons() {
+  for (int found = -1; found;) {
+    found = 0;
+    for (int i = 0; i < weakVectors.count; i++) {
+      vector v = weakVectors.items[i], key = idx(v, 0), value = idx(v, 1);
+      if (vectorType(v) == EPHEMERON && key && isMarked(key) && value && !isMarked(value)) {
+        shade(value);
+        found = -1;
+      }
+    }
+    if (found) markInParallel();
+  }
+}
+void clearWeakReferences() {
+  vector v;
+  while ((v = popGray(&weakVectors))) {
+    vector referent = idx(v, 0);
+    if (referent && isMarked(referent)) continue;
+    v->data[0] = 0;
+    if (vectorType(v) == EPHEMERON) v->data[1] = 0;
+  }
+}
+// Scan one gray vector, if there are any.
+void scan() {
+  vector v = popGray(&grayStacks[0]);
+  if (v) traceVector(v, shade);
+}
+// The objects named from C are live whether or not anything else refers to them, as are the threads' edens.
+void markRoots() {
+  mark(garbageCollectorRoot);
+  for (obj **o = objectGlobals; *o; o++) mark(**o);
+  mark(emptySlots);
+  void markEden(vector td) {
+    edenRoots *er = threadEdenRoots(td);
+    if (er) for (int i = 0; i < er->count; i++) mark(er->roots[i]);
+  }
+  forEachThreadData(markEden);
+}
+// A full collection starts out taking every vector to be dead, old or young.
+void unmarkHeap() {
+  for (arena a = firstArena; a; a = a->next) memset(a->marks, 0, bitmapSize((atom *)a->top - (atom *)a->bottom));
+  for (arena a = largeArenas; a; a = a->next) a->marks[0] = 0;
+  setMarkBit(emptyVector);
+  while (popRemembered());
+  weakVectors.count = 0;
+}
+
+long nanoseconds() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+long pauseStart;
+
+// Wait until every other thread is parked, whether at a safepoint, waiting on a promise or blocked in a
+// system call, so that none of them touches the heap while we mark and sweep. Must be called with the GC
+// lock held. The thread list lock isn't held while we wait, since a running thread may be about to take it.
+void stopTheWorld() {
+  pauseStart = nanoseconds();
+  collectionPending = -1;
+  __sync_synchronize();
+  int running;
+  void checkParked(vector td) {
+    threadStack *ts = threadStackOf(td);
+    if (td != currentThread && ts && !ts->parked) running = -1;
+  }
+  for (;;) {
+    running = 0;
+    forEachThreadData(checkParked);
+    if (!running) return;
+    sched_yield();
+  }
+}
+void resumeTheWorld() {
+  __sync_synchronize();
+  collectionPending = 0;
+  long pause = nanoseconds() - pauseStart;
+  gcStats.pauseNanoseconds += pause;
+  if (pause > gcStats.longestPauseNanoseconds) gcStats.longestPauseNanoseconds = pause;
+}
+
+// The unused parts of the allocation buffers are about to be invalidated, so they were never really allotted.
+void retireAllocationBuffers() {
+  void retire(allocationBuffer *ab) {
+    if (ab->remainder && ab->epoch == collectionEpoch)
+      gcStats.cellsAllotted -= vectorLength(ab->remainder) + VECTOR_HEADER_SIZE;
+  }
+  forEachAllocationBuffer(retire);
+}
+
+// Compaction slides the live vectors of each arena down over the dead ones, recording their new addresses in
+// a forwarding table. Vectors that C code may have pointers into can't be moved: promises and actors (whose
+// payloads hold locks and condition variables), thread data (pointed to from thread-local storage), and
+// anything that a word on some thread's stack points into. Since we can't see into the stack
+// of a thread that's running, every thread but the current one must be parked, as they are when the world
+// has been stopped.
+atom *pins = NULL;
+int pinCount, pinCapacity = 0;
+
+void pin(void *p) {
+  if (!arenaContaining(p)) return;
+  if (pinCount == pinCapacity) {
+    pinCapacity = pinCapacity ? pinCapacity * 2 : 1024;
+    if (!(pins = realloc(pins, pinCapacity * sizeof(atom)))) die("Could not grow the pin list.");
+  }
+  pins[pinCount++] = (atom)p;
+}
+void pinStack(threadStack *ts) {
+  for (atom *p = ts->top; p < ts->bottom; p++) pin((void *)*p);
+}
+// The index of the first pin at or above v.
+int firstPin(vector v) {
+  int low = 0, high = pinCount;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (pins[middle] < (atom)v) low = middle + 1;
+    else high = middle;
+  }
+  return low;
+}
+int isPinnedType(vector v) {
+  return vectorType(v) == PROMISE || vectorType(v) == ACTOR;
+}
+
+typedef struct {
+  vector from, to;
+} forwardingEntry;
+
+// In the order that the heap is walked, so that each arena's entries are in address order.
+forwardingEntry *forwardingTable;
+int forwardingCount, forwardingCapacity;
+
+void addForwarding(vector from, vector to) {
+  if (forwardingCount == forwardingCapacity) {
+    forwardingCapacity = forwardingCapacity ? forwardingCapacity * 2 : 1024;
+    if (!(forwardingTable = realloc(forwardingTable, forwardingCapacity * sizeof(forwardingEntry))))
+      die("Could not grow the forwarding table.");
+  }
+  forwardingTable[forwardingCount].from = from;
+  forwardingTable[forwardingCount++].to = to;
+}
+vector forwardingAddress(vector v) {
+  arena a;
+  if (!v || !(a = arenaContaining(v)) || !isMarked(v)) return v;
+  int low = a->forwarding, high = a->next ? a->next->forwarding : forwardingCount;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (forwardingTable[middle].from < v) low = middle + 1;
+    else high = middle;
+  }
+  return forwardingTable[low].to;
+}
+void forward(vector *reference) {
+  *reference = forwardingAddress(*reference);
+}
+
+__attribute__((noinline)) atom *stackTop() {
+  return __builtin_frame_address(0);
+}
+atom *stackBottom() {
+  pthread_attr_t attributes;
+  void *lowest;
+  size_t size;
+  if (pthread_getattr_np(pthread_self(), &attributes) || pthread_attr_getstack(&attributes, &lowest, &size))
+    die("Could not find the extent of a thread's stack.");
+  pthread_attr_destroy(&attributes);
+  return (atom *)((char *)lowest + size);
+}
+
+// Compact the heap, if the other threads allow it, after marking. Must be called with the world stopped.
+int compact() {
+  threadStack *own = threadStackOf(currentThread);
+  if (!own) return 0;
+  acquireThreadListLock();
+  vector td = garbageCollectorRoot;
+  do if (td != currentThread && !threadStackOf(td)->parked) {
+    releaseThreadListLock();
+    return 0;
+  } while ((td = nextThreadData(td)) != garbageCollectorRoot);
+  __builtin_unwind_init(); // Spill any references held in registers to the stack, where they'll be found.
+  own->top = stackTop();
+  if (!own->bottom) own->bottom = stackBottom();
+  pinCount = 0;
+  pinStack(own);
   do {
-    int remainder = vectorLength(whiteList) - size;
-    if (!remainder) {
-      vector next = whiteList->next;
-      if (next == whiteList) {
-        // The request was for exactly the amount of the last remaining white segment.
-        // TODO: This is unlikely, can we make it impossible and avoid the need for this logic?
-        vector used = whiteList;
-        collectGarbage();
-        if (next == whiteList) die("Free list still empty after garbage collection.");
-        return vectorLength(used) == size ? extract(used) : doAllotment(size);
+    if (td != currentThread) pinStack(threadStackOf(td));
+    pin(td);
+    pin(idx(td, 5));
+    pin(idx(td, 6));
+    pin(idx(td, 7));
+  } while ((td = nextThreadData(td)) != garbageCollectorRoot);
+  releaseThreadListLock();
+  int compare(const void *a, const void *b) {
+    return *(atom *)a < *(atom *)b ? -1 : *(atom *)a > *(atom *)b;
+  }
+  qsort(pins, pinCount, sizeof(atom), compare);
+
+  // Decide where each live vector goes.
+  forwardingCount = 0;
+  for (arena a = firstArena; a; a = a->next) {
+    a->forwarding = forwardingCount;
+    vector fill = arenaStart(a);
+    int p = firstPin(fill);
+    for (vector v = fill, end; v != a->top; v = end) {
+      end = endOfVector(v);
+      if (!isMarked(v)) continue;
+      int pinned = isPinnedType(v);
+      for (; p < pinCount && pins[p] < (atom)end; p++) if (pins[p] >= (atom)v) pinned = -1;
+      vector to = pinned ? v : fill;
+      addForwarding(v, to);
+      fill = (vector)((atom *)to + ((atom *)end - (atom *)v));
+    }
+  }
+
+  // Update every reference to a live vector, from the heap and from the objects' C identifiers.
+  for (arena a = firstArena; a; a = a->next)
+    for (vector v = arenaStart(a); v != a->top; v = endOfVector(v)) if (isMarked(v)) traceReferences(v, forward);
+  for (arena a = largeArenas; a; a = a->next) traceReferences(a->bottom, forward);
+  for (obj **o = objectGlobals; *o; o++) forward(*o);
+  forward(&emptySlots);
+  for (int i = 0; i < finalizableCount; i++) forward(&finalizables[i].v);
+  do {
+    edenRoots *er = threadEdenRoots(td);
+    for (int i = 0; i < er->count; i++) forward(&er->roots[i]);
+  } while ((td = nextThreadData(td)) != garbageCollectorRoot);
+
+  // Move the vectors. The space left between the last vector moved and the next pinned one is made into a
+  // white segment, and arenas left empty are given back.
+  clearWhiteSegments();
+  liveSegmentCount = freeCellCount = 0;
+  arena *link = &firstArena;
+  lastArena = NULL;
+  int i = 0, largest = 0;
+  for (arena a = firstArena, next; a; a = next) {
+    next = a->next;
+    vector fill = arenaStart(a);
+    void release(vector end) {
+      int cells = (atom *)end - (atom *)fill;
+      if (!cells) return;
+      fill->type = cells - VECTOR_HEADER_SIZE << TAG_BIT_COUNT | ATOM_VECTOR;
+      freeCellCount += cells;
+      if (vectorLength(fill) > largest) largest = vectorLength(fill);
+      addWhiteSegment(fill);
+      releasePages(fill);
+    }
+    // The survivors are old, so their mark bits are set again wherever they end up.
+    memset(a->marks, 0, bitmapSize((atom *)a->top - (atom *)a->bottom));
+    for (int last = next ? next->forwarding : forwardingCount; i < last; i++) {
+      vector v = forwardingTable[i].from, to = forwardingTable[i].to;
+      int cells = (atom *)endOfVector(v) - (atom *)v;
+      release(to);
+      memmove(to, v, cells * sizeof(atom));
+      setMarkBit(to);
+      countLive(to);
+      fill = (vector)((atom *)to + cells);
+    }
+    if (fill == a->bottom) { // Never the first arena, which starts with emptyVector.
+      *link = next;
+      int cells = (atom *)a->top - (atom *)a->bottom;
+      heapCells -= cells;
+      setArenaTableEntries(a, NULL);
+      munmap(a, arenaSize(cells));
+      continue;
+    }
+    release(a->top);
+    lastArena = a;
+    link = &a->next;
+  }
+
+  free(forwardingTable); // Two cells for every live vector: too many to keep between compactions.
+  forwardingTable = NULL;
+  forwardingCapacity = 0;
+  setMarkBit(emptyVector);
+  publishLiveCounts(largest);
+  growIfCrowded();
+  gcStats.compactions++;
+  return -1;
+}
+
+// Cells allotted from the white list since the last sweep, less those that minor collections have given back.
+int allottedCells = 0;
+
+typedef struct {
+  vector start, end;
+} youngExtent;
+
+// Where everything allotted since the last collection went. The extents can overlap, where space was given
+// back to the white list and allotted again.
+youngExtent *youngExtents;
+int youngExtentCount = 0, youngExtentCapacity = 0, youngCells = 0;
+
+void recordYoung(vector start, vector end) {
+  youngCells += (atom *)end - (atom *)start;
+  if (youngExtentCount && youngExtents[youngExtentCount - 1].end == start) {
+    youngExtents[youngExtentCount - 1].end = end;
+    return;
+  }
+  if (youngExtentCount == youngExtentCapacity) {
+    youngExtentCapacity = youngExtentCapacity ? youngExtentCapacity * 2 : 1024;
+    if (!(youngExtents = realloc(youngExtents, youngExtentCapacity * sizeof(youngExtent))))
+      die("Could not grow the list of young extents.");
+  }
+  youngExtents[youngExtentCount].start = start;
+  youngExtents[youngExtentCount++].end = end;
+}
+void forgetYoung() {
+  youngExtentCount = youngCells = 0;
+}
+
+// Give the unmarked vectors of the young extents back to the white list.
+void sweepYoung() {
+  int compare(const void *a, const void *b) {
+    vector x = ((youngExtent *)a)->start, y = ((youngExtent *)b)->start;
+    return x < y ? -1 : x > y;
+  }
+  qsort(youngExtents, youngExtentCount, sizeof(youngExtent), compare);
+  for (int i = 0; i < youngExtentCount;) {
+    vector v = youngExtents[i].start, end = youngExtents[i].end;
+    for (i++; i < youngExtentCount && youngExtents[i].start <= end; i++)
+      if (youngExtents[i].end > end) end = youngExtents[i].end;
+    while (v != end)
+      if (isMarked(v)) v = endOfVector(v);
+      else {
+        vector base = v;
+        do v = endOfVector(v); while (v != end && !isMarked(v));
+        setVectorLength(base, (atom *)v - (atom *)base->data);
+        allottedCells -= (atom *)v - (atom *)base;
+        addWhiteSegment(base);
+        releasePages(base);
       }
-      vector used = extract(whiteList);
-      whiteList = next;
-      clearMarkBit(used);
-      return used;
+  }
+  forgetYoung();
+}
+
+// Give the unmarked large vectors back to the system, counting the rest if this is a full collection.
+void freeLargeVectors(int full) {
+  for (arena *link = &largeArenas, a; (a = *link);) {
+    if (isMarked(a->bottom)) {
+      if (full) countLive(a->bottom);
+      link = &a->next;
+      continue;
     }
-    if (remainder >= VECTOR_HEADER_SIZE) {
-      vector excess = replace(whiteList, (vector)&whiteList->data[size]),
-             used = whiteList;
-      setVectorLength(excess, remainder - VECTOR_HEADER_SIZE);
-      clearMarkBit(excess); // TODO: Combine this with setting the length.
-      setVectorLength(used, size);
-      whiteList = excess;
-      return used;
+    *link = a->next;
+    int cells = (atom *)a->top - (atom *)a->bottom;
+    largeCells -= cells;
+    munmap(a, largeArenaSize(cells));
+  }
+}
+
+// Must be called with the GC lock held, and not during a cycle.
+void collectYoung() {
+  stopTheWorld();
+  marking = -1;
+  markRoots();
+  vector v;
+  while ((v = popRemembered())) {
+    if (isMarked(v)) traceVector(v, shade);
+    else shade(v);
+  }
+  markInParallel();
+  markEphemerons();
+  clearWeakReferences();
+  marking = 0;
+  grayStacks[0].count = 0;
+  finalizeUnmarked(oldFinalizables);
+  freeLargeVectors(0);
+  retireAllocationBuffers();
+  sweepYoung();
+  gcStats.minorCollections++;
+  ++collectionEpoch; // The allocation buffers have been swept up along with everything else.
+  resumeTheWorld();
+}
+
+// A heap census counts the live vectors by type, and the live objects by prototype, in a form that an offline
+// script can diff against an earlier census:
+//   type <name> <vectors> <cells>
+//   prototype <name> <objects> <cells>
+//   total <vectors> <cells>
+// An object's cells include those of its values, but not of their shared shape. Prototypes named from C go
+// by the name of their global, and the rest by their address. Prototypes are listed largest first.
+FILE *censusFile = NULL;
+
+typedef struct {
+  vector proto;
+  long objects, cells;
+} censusEntry;
+
+// Objects aren't tagged as such, so we go by their layout: a prototype, and values headed by a shape.
+int looksLikeObject(vector v) {
+  int type = vectorType(v);
+  if (type == ATOM_VECTOR || type == PROMISE || type == ACTOR || vectorLength(v) != 4) return 0;
+  vector p = idx(v, 0), s = idx(v, 1);
+  return p && s && vectorLength(p) == 4 && vectorType(s) == ENTITY_VECTOR && vectorLength(s)
+      && idx(s, 0) && vectorType(idx(s, 0)) == SHAPE;
+}
+// The name of the global that refers to v, if any.
+const char *globalName(vector v) {
+  for (int i = 0; objectGlobals[i]; i++) if (*objectGlobals[i] == v) return objectGlobalNames[i];
+  return NULL;
+}
+// Must be called after marking, before the sweep or compaction.
+void writeCensus(FILE *f) {
+  long vectors[VECTOR_TYPES] = {0}, cells[VECTOR_TYPES] = {0};
+  int capacity = 0, protos = 0;
+  censusEntry *entries = NULL;
+  // An open hash table keyed by prototype, kept at most half full.
+  censusEntry *entryFor(vector proto) {
+    if (protos * 2 >= capacity) {
+      censusEntry *old = entries;
+      int oldCapacity = capacity;
+      capacity = capacity ? capacity * 2 : 1024;
+      if (!(entries = calloc(capacity, sizeof(censusEntry)))) die("Could not grow the census table.");
+      protos = 0;
+      for (int i = 0; i < oldCapacity; i++)
+        if (old[i].proto) *entryFor(old[i].proto) = old[i];
+      free(old);
     }
-  } while ((whiteList = whiteList->next) != firstWhiteSegment);
-  return 0;
+    int i = (atom)proto / sizeof(atom) & capacity - 1;
+    while (entries[i].proto && entries[i].proto != proto) i = i + 1 & capacity - 1;
+    if (!entries[i].proto) {
+      entries[i].proto = proto;
+      protos++;
+    }
+    return &entries[i];
+  }
+  void tally(vector v) {
+    int n = vectorLength(v) + VECTOR_HEADER_SIZE;
+    vectors[vectorType(v)]++;
+    cells[vectorType(v)] += n;
+    if (!looksLikeObject(v)) return;
+    censusEntry *e = entryFor(idx(v, 0));
+    e->objects++;
+    vector slots = idx(v, 1);
+    e->cells += n + (slots == emptySlots ? 0 : vectorLength(slots) + VECTOR_HEADER_SIZE);
+  }
+  for (arena a = firstArena; a; a = a->next)
+    for (vector v = arenaStart(a); v != a->top; v = endOfVector(v)) if (isMarked(v)) tally(v);
+  for (arena a = largeArenas; a; a = a->next) tally(a->bottom);
+
+  long totalVectors = 0, totalCells = 0;
+  for (int i = 0; i < VECTOR_TYPES; i++) {
+    fprintf(f, "type %s %ld %ld\n", vectorTypeNames[i], vectors[i], cells[i]);
+    totalVectors += vectors[i];
+    totalCells += cells[i];
+  }
+  int compare(const void *a, const void *b) {
+    long x = ((censusEntry *)a)->cells, y = ((censusEntry *)b)->cells;
+    return x < y ? 1 : x > y ? -1 : 0;
+  }
+  qsort(entries, capacity, sizeof(censusEntry), compare);
+  for (int i = 0; i < protos; i++) {
+    const char *name = globalName(entries[i].proto);
+    if (name) fprintf(f, "prototype %s %ld %ld\n", name, entries[i].objects, entries[i].cells);
+    else fprintf(f, "prototype %p %ld %ld\n", (void *)entries[i].proto, entries[i].objects, entries[i].cells);
+  }
+  fprintf(f, "total %ld %ld\n", totalVectors, totalCells);
+  free(entries);
+}
+
+// Finish any cycle that is under way with the world stopped, and sweep.
+// Must be called with the GC lock held.
+void collect() {
+  stopTheWorld();
+  retireAllocationBuffers();
+  finishSweeping();
+  if (!marking) unmarkHeap();
+  markRoots();
+  markInParallel();
+  markEphemerons();
+  clearWeakReferences();
+  marking = 0;
+  grayStacks[0].count = 0; // Anything shaded since marking finished is marked already, and may die later.
+  finalizeUnmarked(0);
+  freeLargeVectors(-1);
+  if (censusFile) writeCensus(censusFile);
+  if (compactionWanted && compact()) compactionWanted = 0;
+  else startSweeping();
+  allottedCells = 0;
+  forgetYoung();
+  gcStats.fullCollections++;
+  ++collectionEpoch; // Buffers carved out before the sweep may now overlap live vectors.
+  ++lookupEpoch; // Vectors have died, and may have moved.
+  resumeTheWorld();
+}
+
+// A cycle is started once INCREMENTAL_THRESHOLD percent of the free space left by the last sweep has been
+// allotted. From then on at most MARKING_BUDGET gray vectors are scanned for every COLLECTION_WORK_CELLS cells
+// allotted, and once none are left the cycle is finished off by collect(). The work falls due in the middle
+// of an allotment, but is left to the allotting thread's next safepoint.
+#ifndef INCREMENTAL_THRESHOLD
+  #define INCREMENTAL_THRESHOLD 50
+#endif
+#ifndef MARKING_BUDGET
+  #define MARKING_BUDGET 256
+#endif
+#ifndef COLLECTION_WORK_CELLS
+  #define COLLECTION_WORK_CELLS 1024
+#endif
+
+volatile int collectionWorkDue = 0;
+int cellsUntilCollectionWork = COLLECTION_WORK_CELLS;
+
+void startCycle() {
+  stopTheWorld();
+  unmarkHeap();
+  markRoots();
+  marking = -1;
+  gcStats.incrementalCycles++;
+  resumeTheWorld();
+}
+// Must be called with the GC lock held.
+void collectIncrementally() {
+  collectionWorkDue = 0;
+  if (!marking) {
+    if (!sweepArena && allottedCells > freeCellCount / 100 * INCREMENTAL_THRESHOLD) startCycle();
+    else if (NURSERY_CELLS && youngCells > NURSERY_CELLS) collectYoung();
+    return;
+  }
+  vector v;
+  for (int budget = MARKING_BUDGET; budget--;)
+    if ((v = popGray(&grayStacks[0]))) traceVector(v, shade);
+    else tailcall(collect);
+}
+// Another thread may have done the work while we waited for the lock.
+void collectIfDue() {
+  if (collectionWorkDue) collectIncrementally();
+}
+
+pthread_mutex_t GCLock = PTHREAD_MUTEX_INITIALIZER;
+void acquireGCLock() {
+  if (pthread_mutex_lock(&GCLock)) die("Error while acquiring GC mutex.");
+}
+void releaseGCLock() {
+  if (pthread_mutex_unlock(&GCLock)) die("Error while releasing GC mutex.");
 }
 
+// Run f, which mustn't touch the heap, with the current thread parked: its stack is published for the
+// compactor, and collections may go ahead without it. The registers are spilled into this function's frame,
+// which stays put until f returns. Returns with the GC lock held, so that no collection is under way once
+// the thread is running again.
+void parked(void (*f)(void)) {
+  threadStack *ts = threadStackOf(currentThread);
+  if (!ts) {
+    f();
+    tailcall(acquireGCLock);
+  }
+  __builtin_unwind_init();
+  if (!ts->bottom) ts->bottom = stackBottom();
+  ts->top = stackTop();
+  __sync_synchronize();
+  ts->parked = -1;
+  f();
+  acquireGCLock();
+  ts->parked = 0;
+}
+// Any thread that may block on the GC lock has to be parked first, or a collector waiting for it to
+// reach a safepoint would wait forever.
+void acquireGCLockParked() {
+  void nothing() {}
+  parked(nothing);
+}
+void blockingCall(void (*f)(void)) {
+  parked(f);
+  releaseGCLock();
+}
+void collectWith(void (*f)(void)) {
+  acquireGCLockParked();
+  f();
+  releaseGCLock();
+}
+void collectGarbage() {
+  collectWith(collect);
+}
+// Just a minor collection, unless a cycle is under way.
+void collectYoungGarbage() {
+  void minor() {
+    if (marking) collect();
+    else collectYoung();
+  }
+  collectWith(minor);
+}
+// As above, but compacting the heap if the other threads allow it.
+void compactGarbage() {
+  compactionWanted = -1;
+  collectGarbage();
+}
+// As above, writing a census of the survivors to f.
+void writeHeapCensus(FILE *f) {
+  void census() {
+    censusFile = f;
+    collect();
+    censusFile = NULL;
+  }
+  collectWith(census);
+}
+// Signal handlers can't touch the heap, so the census is left to the next thread to reach a safepoint.
+volatile sig_atomic_t censusRequested = 0;
+void requestHeapCensus(int signal) {
+  censusRequested = -1;
+}
+// Any number of threads may see the request at once, but only the one that clears it takes the census. A
+// census that can't be written is reported and given up, rather than taking the program down with it.
+void writeRequestedCensus() {
+  static int censusCount = 0;
+  if (!__sync_lock_test_and_set(&censusRequested, 0)) return;
+  char name[64];
+  snprintf(name, sizeof(name), "gospel-%d-%d.census", (int)getpid(), __sync_add_and_fetch(&censusCount, 1));
+  FILE *f = fopen(name, "w");
+  if (!f) {
+    fprintf(stderr, "Could not open %s for the heap census: %s\n", name, strerror(errno));
+    return;
+  }
+  writeHeapCensus(f);
+  fclose(f);
+}
+
+// Step aside for a collection that is waiting for us, do the collection work that our allotments have made
+// due, or take a census that has been asked for.
+void safepoint() {
+  if (censusRequested) writeRequestedCensus();
+  if (collectionWorkDue) collectWith(collectIfDue);
+  if (!collectionPending) return;
+  acquireGCLockParked();
+  releaseGCLock();
+}
+gcStatistics garbageCollectorStatistics() {
+  acquireGCLockParked();
+  gcStatistics s = gcStats;
+  s.largeCells = largeCells;
+  releaseGCLock();
+  return s;
+}
+
+// Allot "size" cells from the front of a segment taken off the white list, giving back the rest.
+vector allotFrom(vector used, int size) {
+  int remainder = vectorLength(used) - size;
+  if (remainder) {
+    vector excess = (vector)&used->data[size];
+    // The excess header lands on stale data: give it a type whose contents are never traced.
+    excess->type = remainder - VECTOR_HEADER_SIZE << TAG_BIT_COUNT | ATOM_VECTOR;
+    setVectorLength(used, size);
+    addWhiteSegment(excess);
+  }
+  clearMarkBit(used);
+  allottedCells += size + VECTOR_HEADER_SIZE;
+  gcStats.cellsAllotted += size + VECTOR_HEADER_SIZE;
+  if ((cellsUntilCollectionWork -= size + VECTOR_HEADER_SIZE) <= 0) {
+    cellsUntilCollectionWork = COLLECTION_WORK_CELLS;
+    collectionWorkDue = -1;
+  }
+  recordYoung(used, endOfVector(used));
+  return used;
+}
+vector allotWhite(int size) {
+  vector used = takeWhiteSegment(size);
+  return used ? allotFrom(used, size) : 0;
+}
+// Sweep more of the heap as long as there's no room on the white list.
+vector doAllotment(int size) {
+  vector v;
+  int swept;
+  while (!(v = allotWhite(size)) && (swept = sweep(SWEEP_CELLS))) gcStats.cellsSweptLazily += swept;
+  return v;
+}
+
+// Must be called with the GC lock held.
+vector allotLarge(int size) {
+  int cells = size + VECTOR_HEADER_SIZE;
+  if (heapCells + largeCells + cells > MAX_HEAP_CELLS) collect();
+  arena a;
+  if (heapCells + largeCells + cells > MAX_HEAP_CELLS || !(a = mapLargeArena(cells)))
+    die("Unable to fulfill allocation request.");
+  vector v = a->bottom;
+  v->type = size << TAG_BIT_COUNT | LARGE_VECTOR_BIT | ATOM_VECTOR;
+  allottedCells += cells;
+  youngCells += cells;
+  gcStats.cellsAllotted += cells;
+  return v;
+}
+// Must be called with the GC lock held.
 vector allot(int size) {
-  vector n = doAllotment(size);
+  vector n = size >= LARGE_VECTOR_CELLS ? allotLarge(size) : doAllotment(size);
   if (!n) {
-    collectGarbage();
-    if (!(n = doAllotment(size))) die("Unable to fulfill allocation request.");
+    collect();
+    // Leave room to split off a remainder, so that doAllotment() doesn't take the whole new arena.
+    if (!(n = doAllotment(size)) && (!growHeap(size + 2 * VECTOR_HEADER_SIZE) || !(n = doAllotment(size))))
+      die("Unable to fulfill allocation request.");
   }
+  if (marking) setMarkBit(n);
   return n;
 }
 
+// Cells carved out of the white list at a time, including the header of the buffer's remainder vector.
+#define ALLOCATION_BUFFER_CELLS 1024
+// Larger requests bypass the buffer, so that it isn't discarded after a handful of allocations.
+#define LARGEST_BUFFERED_ALLOTMENT (ALLOCATION_BUFFER_CELLS / 4)
+
+vector newAllocationBuffer() {
+  return zero(makeAtomVector(CELLS_REQUIRED_FOR_BYTES(sizeof(allocationBuffer))));
+}
+
+// Take "size" cells off the front of the buffer, leaving the rest formatted as a free vector.
+vector bump(allocationBuffer *ab, int size) {
+  vector v = ab->remainder;
+  if (!v || ab->epoch != collectionEpoch) return 0;
+  int spare = vectorLength(v) - size;
+  if (!spare) ab->remainder = 0;
+  else if (spare >= VECTOR_HEADER_SIZE) {
+    ab->remainder = (vector)&v->data[size];
+    ab->remainder->type = spare - VECTOR_HEADER_SIZE << TAG_BIT_COUNT | ATOM_VECTOR;
+  }
+  else return 0;
+  v->type = size << TAG_BIT_COUNT | ATOM_VECTOR;
+  if (marking) setMarkBit(v);
+  return v;
+}
+
+// Must be called with the GC lock held.
+vector refill(allocationBuffer *ab, int size) {
+  if (size > LARGEST_BUFFERED_ALLOTMENT) return allot(size);
+  // Give back what is left of the old buffer, rather than leaving it stranded until the next collection.
+  if (ab->remainder && ab->epoch == collectionEpoch) {
+    gcStats.cellsAllotted -= vectorLength(ab->remainder) + VECTOR_HEADER_SIZE;
+    addWhiteSegment(ab->remainder);
+  }
+  ab->remainder = 0;
+  vector b = doAllotment(ALLOCATION_BUFFER_CELLS - VECTOR_HEADER_SIZE);
+  // Once the survivors of minor collections have broken the free space up into holes too small for a whole
+  // buffer, make do with the largest hole, so that the allocations that follow can still be bumped. Only
+  // if there's none big enough for the vector is it allotted directly, collecting if necessary.
+  if (!b && (b = takeLargestWhiteSegment(size))) b = allotFrom(b, vectorLength(b));
+  if (!b) return allot(size);
+  b->type = vectorLength(b) << TAG_BIT_COUNT | ATOM_VECTOR;
+  ab->remainder = b;
+  ab->epoch = collectionEpoch;
+  return bump(ab, size);
+}
+
+// Must be called between forbidGC() and permitGC().
+vector threadAllot(int size) {
+  allocationBuffer *ab = threadAllocationBuffer(currentThread);
+  if (!ab) return allot(size); // forbidGC() took the GC lock for us.
+  vector v = bump(ab, size);
+  if (v) return v;
+  acquireGCLockParked();
+  v = refill(ab, size);
+  releaseGCLock();
+  return v;
+}
+
 vector zero(vector v) {
   memset(v->data, 0, vectorLength(v) * sizeof(atom));
   return v;
@@ -434,10 +1844,11 @@ int atomIdx(vector v, int i) {
 vector *idxPointer(vector v, int i) {
   return (vector *)&v->data[i];
 }
-vector *edenIdx(vector v, int i) {
-  return (vector *)&v->data[i];
-}
 void *setIdx(vector v, int i, void *e) {
+  if (e && vectorType(v) != ATOM_VECTOR) {
+    if (marking) shade(e);
+    else if (NURSERY_CELLS) rememberIfOldToYoung(v, e);
+  }
   return v->data[i] = e;
 }
 void *vectorData(vector v) {
@@ -447,23 +1858,65 @@ void *vectorData(vector v) {
 vector shelter(vector, vector);
 vector shelteredValue(vector);
 void invalidateEden() {
+  edenRoots *er = threadEdenRoots(currentThread);
+  if (er) er->count = er->floor;
   shelter(currentThread, 0);
 }
+// Keep the current eden from being invalidated until restoreEden() is passed the result.
+int protectEden() {
+  edenRoots *er = threadEdenRoots(currentThread);
+  if (!er) return 0;
+  int floor = er->floor;
+  er->floor = er->count;
+  return floor;
+}
+void restoreEden(int floor) {
+  edenRoots *er = threadEdenRoots(currentThread);
+  if (er) er->floor = floor;
+}
+// Allocation sampling, for profiling: each time a thread has allotted another samplingInterval cells, the
+// sampler is called, before the next vector is allotted. The sampler mustn't allot anything itself. Another
+// thread can stop the sampling at any moment, so each is read just once.
+volatile int samplingInterval = 0;
+void (*volatile allocationSampler)(void);
+
+void sampleAllocations(int interval, void (*sampler)(void)) {
+  allocationSampler = sampler;
+  samplingInterval = interval;
+}
+void countAllotment(int cells) {
+  int interval = samplingInterval;
+  void (*sampler)(void) = allocationSampler;
+  allocationBuffer *ab = threadAllocationBuffer(currentThread);
+  if (!ab || !interval || !sampler) return;
+  // A vector bigger than the interval is sampled more than once.
+  for (ab->untilSample -= cells; ab->untilSample <= 0; ab->untilSample += interval) sampler();
+}
+
 vector edenAllot(int n) {
   forbidGC();
-  vector v = allot(2);
+  if (samplingInterval) countAllotment(n + VECTOR_HEADER_SIZE);
+  edenRoots *er = threadEdenRoots(currentThread);
+  if (er && er->count < EDEN_ROOTS) {
+    // The roots vector is pinned, so "er" stays put even if this allotment compacts the heap.
+    vector v = threadAllot(n);
+    return er->roots[er->count++] = v;
+  }
+  // Without room in the roots, link an eden record onto the sheltered value instead.
+  vector v = threadAllot(2);
   setVectorType(v, ENTITY_VECTOR);
   setIdx(v, 0, 0);
   setIdx(v, 1, shelteredValue(currentThread));
   shelter(currentThread, v);
   // Now that the eden vector is in a consistent state, we can request the second allotment and not mind
   // that it could trigger a garbage collection.
-  return setIdx(v, 0, allot(n));
+  return setIdx(v, 0, threadAllot(n));
 }
 vector duplicateVector(vector v) {
   int n = vectorLength(v);
   vector nv = edenAllot(n);
   memcpy(nv, v, (n + VECTOR_HEADER_SIZE) * sizeof(atom));
+  shadeReferences(nv);
   permitGC();
   return nv;
 }
@@ -487,7 +1940,13 @@ vector newVector(int length, ...) {
   vector v = allotVector(length, ENTITY_VECTOR);
   va_list members;
   va_start(members, length);
-  for (int i = 0; i < length; i++) setIdx(v, i, va_arg(members, void *));
+  // Nothing can collect before permitGC(), so "v" is young, or black if allotted while marking, and its
+  // members need only the marking barrier.
+  for (int i = 0; i < length; i++) {
+    void *e = va_arg(members, void *);
+    if (marking && e) shade(e);
+    v->data[i] = e;
+  }
   va_end(members);
   permitGC();
   return v;
@@ -503,25 +1962,19 @@ vector newAtomVector(int length, ...) {
 }
 
 void initializeHeap() {
-  void *memory;
-  if (!(memory = malloc(ARENA_CELLS * sizeof(atom) + 1024))) die("Could not allocate heap.");
-  // The gray list and black list (being in the same cycle) must have distinct pointers.
+  if (!(firstArena = lastArena = mapArena(HEAP_CELLS))) die("Could not allocate heap.");
+  heapCells = HEAP_CELLS;
   // "emptyVector" is treated specially by the garbage collector: The heap is considered to begin
-  // immediately after its end, so that it is never collected. It must always be at the lowest address.
-  
-  blackList = emptyVector = heap = memory;
-  setVectorLength(blackList, 0);
-  setVectorType(blackList, ATOM_VECTOR);
-  grayList = endOfEmptyVector(blackList);
-  setVectorLength(grayList, 0);
-  setVectorType(grayList, ATOM_VECTOR);
-  grayList->prev = grayList->next = blackList;
-  blackList->prev = blackList->next = grayList;
-  setMarkBit(blackList);
-  setMarkBit(grayList);
-  whiteList = endOfEmptyVector(grayList);
-  setVectorLength(whiteList, ARENA_CELLS - VECTOR_HEADER_SIZE * 3);
-  whiteList->prev = whiteList->next = whiteList;
+  // immediately after its end, so that it is never collected. It must always be at the lowest address
+  // of the first arena.
+  emptyVector = firstArena->bottom;
+  setVectorLength(emptyVector, 0);
+  setVectorType(emptyVector, ATOM_VECTOR);
+  setMarkBit(emptyVector);
+  vector white = endOfEmptyVector(emptyVector);
+  setVectorLength(white, HEAP_CELLS - VECTOR_HEADER_SIZE * 2);
+  addWhiteSegment(white);
+  freeCellCount = HEAP_CELLS - VECTOR_HEADER_SIZE;
 }
 
 pthread_mutex_t threadListMutex = PTHREAD_MUTEX_INITIALIZER;
@@ -533,8 +1986,12 @@ void releaseThreadListLock() {
 }
 
 pthread_mutex_t symbolTableMutex = PTHREAD_MUTEX_INITIALIZER;
+// The holder of a lock may be stopped at a safepoint, so we park while we wait for it.
 void acquireSymbolTableLock() {
-  if (pthread_mutex_lock(&symbolTableMutex)) die("Error while acquiring symbol table lock.");
+  void lock() {
+    if (pthread_mutex_lock(&symbolTableMutex)) die("Error while acquiring symbol table lock.");
+  }
+  if (pthread_mutex_trylock(&symbolTableMutex)) blockingCall(lock);
 }
 void releaseSymbolTableLock() {
   if (pthread_mutex_unlock(&symbolTableMutex)) die("Error while releasing symbol table lock.");
@@ -561,14 +2018,19 @@ promise newPromise() {
 obj promiseValue(promise p) {
   return ((promiseData *)vectorData(p))->value;
 }
-void markPromise(promise p) {
-  mark(promiseValue(p));
-  mark(((promiseData *)vectorData(p))->actor);  
+void tracePromise(promise p, void (*f)(vector)) {
+  f(promiseValue(p));
+  f(((promiseData *)vectorData(p))->actor);
+}
+void tracePromiseReferences(promise p, void (*f)(vector *)) {
+  promiseData *pd = (promiseData *)vectorData(p);
+  f(&pd->value);
+  f(&pd->actor);
 }
 void fulfillPromise(obj p, obj o) {
   promiseData *pd = (promiseData *)vectorData(p);
   if (pthread_mutex_lock(&pd->mutex)) die("Error while acquiring a promise lock before fulfillment.");
-  if (!pd->value) pd->value = o;
+  if (!pd->value) pd->value = writeBarrier(o);
   if (pthread_cond_broadcast(&pd->conditionVariable))
     die("Error while waking up threads waiting on a promise.");
   if (pthread_mutex_unlock(&pd->mutex)) die("Error while releasing a promise lock after fulfillment.");
@@ -584,13 +2046,27 @@ typedef struct {
   promise currentPromise;
 } actorData;
 
-void markActor(vector a) {
+void traceActor(vector a, void (*f)(vector)) {
+  actorData *ad = vectorData(a);
+  f(ad->frontOfQueue);
+  f(ad->object);
+  f(ad->scope);
+  f(ad->env);
+}
+// The rest are reachable through the queue and the thread list, but still have to be updated.
+void traceActorReferences(vector a, void (*f)(vector *)) {
   actorData *ad = vectorData(a);
-  mark(ad->frontOfQueue);
-  mark(ad->object);
+  f(&ad->frontOfQueue);
+  f(&ad->backOfQueue);
+  f(&ad->object);
+  f(&ad->scope);
+  f(&ad->env);
+  f(&ad->threadData);
+  f(&ad->currentPromise);
 }
 void acquireQueueLock(actorData *ad) {
-  pthread_mutex_lock(&ad->queueLock);
+  void lock() { pthread_mutex_lock(&ad->queueLock); }
+  if (pthread_mutex_trylock(&ad->queueLock)) blockingCall(lock);
 }
 void releaseQueueLock(actorData *ad) {
   pthread_mutex_unlock(&ad->queueLock);
@@ -605,7 +2081,7 @@ void actorLoop(vector a) {
   setCurrentThread(ad->threadData);
   setCurrentActor(currentThread, a);
   for (;;) {
-    setContinuation(subexpressionContinuation(ad->currentPromise = idx(ad->frontOfQueue, 1),
+    setContinuation(subexpressionContinuation(ad->currentPromise = writeBarrier(idx(ad->frontOfQueue, 1)),
                                               ad->scope,
                                               ad->env,
                                               ad->object,
@@ -613,9 +2089,10 @@ void actorLoop(vector a) {
                                               idx(ad->frontOfQueue, 3),
                                               0));
     setjmp(ad->toplevelEscape);
+    restoreEden(0); // Any nested calls that protected their edens have been escaped from.
     doNext();
     acquireQueueLock(ad);
-    if (!(ad->frontOfQueue = idx(ad->frontOfQueue, 0))) {
+    if (!(ad->frontOfQueue = writeBarrier(idx(ad->frontOfQueue, 0)))) {
       // There are no more messages in the queue, we can terminate this thread.
       ad->backOfQueue = NULL;
       killThreadData(ad->threadData);
@@ -628,12 +2105,12 @@ void actorLoop(vector a) {
 }
 promise enqueueMessage(vector a, obj selector, vector args) {
   promise p = newPromise();
-  actorData *ad = vectorData(((promiseData *)vectorData(p))->actor = a);
+  actorData *ad = vectorData(((promiseData *)vectorData(p))->actor = writeBarrier(a));
   acquireQueueLock(ad);
   vector v = newVector(4, NULL, p, selector, args);
   if (!ad->backOfQueue) {
     // The queue is empty, we must start a new thread for the actor.  
-    ad->frontOfQueue = ad->backOfQueue = v;
+    ad->frontOfQueue = ad->backOfQueue = writeBarrier(v);
     ad->threadData = addThread(garbageCollectorRoot);
     createPrimitiveThread((void (*)(void *))actorLoop, a);
   }
@@ -648,35 +2125,48 @@ promise currentPromise() {
   return ((actorData *)vectorData(currentActor(currentThread)))->currentPromise;
 }
 vector newActor(obj o, obj scope, obj env) {
-  vector a = makeAtomVector(CELLS_REQUIRED_FOR_BYTES(sizeof(actorData)));
+  vector a = zero(makeAtomVector(CELLS_REQUIRED_FOR_BYTES(sizeof(actorData))));
   actorData *ad = vectorData(a);
   if (pthread_mutex_init(&ad->queueLock, NULL))
     die("Error while initializing an actor's message queue lock.");
-  ad->object = o;
-  ad->scope = scope;
-  ad->env = env;
-  // frontOfQueue, backOfQueue and currentThread initialized to NULL by newAtomVector().
+  ad->object = writeBarrier(o);
+  ad->scope = writeBarrier(scope);
+  ad->env = writeBarrier(env);
+  // frontOfQueue, backOfQueue and threadData initialized to NULL by zero(), the memory may be reused.
   setVectorType(a, ACTOR);
   return a;
 }
 
+vector newThreadStack() {
+  return zero(makeAtomVector(CELLS_REQUIRED_FOR_BYTES(sizeof(threadStack))));
+}
+vector newEdenRoots() {
+  return zero(makeAtomVector(CELLS_REQUIRED_FOR_BYTES(sizeof(edenRoots))));
+}
+// The promise is pinned, so "pd" stays put while we're parked.
 obj waitFor(void *e) {
   if (!isPromise(e)) return e;
   promiseData *pd = (promiseData *)vectorData(e);
-  if (pthread_mutex_lock(&pd->mutex)) die("Error while acquiring a promise lock before a wait.");
-  while (!pd->value)
-    if (pthread_cond_wait(&pd->conditionVariable, &pd->mutex))
-      die("Error while attempting to wait on a promise.");
-  if (pthread_mutex_unlock(&pd->mutex)) die("Error while releasing a promise lock after a wait.");
+  void await() {
+    if (pthread_mutex_lock(&pd->mutex)) die("Error while acquiring a promise lock before a wait.");
+    while (!pd->value)
+      if (pthread_cond_wait(&pd->conditionVariable, &pd->mutex))
+        die("Error while attempting to wait on a promise.");
+    if (pthread_mutex_unlock(&pd->mutex)) die("Error while releasing a promise lock after a wait.");
+  }
+  if (!pd->value) blockingCall(await);
   return pd->value;
 }
 
-pthread_mutex_t GCLock = PTHREAD_MUTEX_INITIALIZER;
+// Between these calls the current thread may hold half-initialized vectors, so no collection may run.
+// Threads with an allocation buffer take no lock: other threads only collect once every thread is parked,
+// and this one only parks at a safepoint, or when refilling its buffer with nothing half-initialized.
 void forbidGC() {
-  if (pthread_mutex_lock(&GCLock)) die("Error while acquiring GC mutex.");
+  if (!threadAllocationBuffer(currentThread)) tailcall(acquireGCLock);
+  safepoint();
 }
 void permitGC() {
-  if (pthread_mutex_unlock(&GCLock)) die("Error while releasing GC mutex.");
+  if (!threadAllocationBuffer(currentThread)) tailcall(releaseGCLock);
 }
 
 
@@ -690,26 +2180,153 @@ vector suffix(void *e, vector v) {
   vector nv = makeVector(l + 1);
   nv->data[l] = e;
   memcpy(nv->data, v->data, l * sizeof(atom));
-  return nv;
+  return shadeReferences(nv);
 }
 vector prefix(void *e, vector v) {
   int l = vectorLength(v);
   vector nv = makeVector(l + 1);
   setIdx(nv, 0, e);
   memcpy((void *)vectorData(nv) + sizeof(atom), vectorData(v), l * sizeof(atom));
-  return nv;
+  return shadeReferences(nv);
+}
+
+
+// Objects that have had the same slots added in the same order share a shape, which holds the names and
+// namespaces of the slots, so that each object need only hold their values:
+//   shape:  <layout: name, namespace, ...> <transitions: name, namespace, shape, ...> <slot table> <slot count>
+//   object: <proto> <values: shape, value, ..., room to grow> <hidden> <dispatch method>
+// A shape never changes, except to gain transitions to the shapes that adding a slot leads to.
+//
+// Shapes of more than HASHED_SLOTS slots share their layout with the shape they were extended from, so that
+// a big object given n slots one at a time doesn't leave behind n copies of it. Like the values of an object,
+// the layout grows into the room left at its end, doubling when there's none, and each of these shapes
+// records how many of its slots there are, in an atom vector. The first shape to extend a layout does so in
+// place; any other copies it. Their slots are found through an open hash table of slot indices keyed by name,
+// which is passed on along with the layout, and so only made again when it's out of room, or once a
+// compaction has moved the names:
+//   <gcStats.compactions when made> <slot index + 1, or 0 if free> ...
+// A table can hold the slots of shapes extended from the one it was made for, which the others skip.
+#ifndef HASHED_SLOTS
+  #define HASHED_SLOTS 32
+#endif
+
+vector newShape(vector layout, int count) {
+  vector shape = newVector(4, layout, emptyVector, NULL,
+                           count > HASHED_SLOTS ? newAtomVector(1, (void *)(atom)count) : NULL);
+  setVectorType(shape, SHAPE);
+  return shape;
+}
+void initializeShapes() {
+  emptySlots = newVector(1, newShape(emptyVector, 0));
+}
+vector emptyShape()              { return idx(emptySlots, 0); }
+vector shapeLayout(vector shape) { return idx(shape, 0); }
+int shapeSlotCount(vector shape) {
+  vector count = idx(shape, 3);
+  return count ? *(atom *)vectorData(count) : vectorLength(shapeLayout(shape)) / 2;
+}
+
+int slotHash(obj name, int capacity) {
+  return (atom)name / sizeof(atom) & capacity - 1;
+}
+// Whether the table is keyed by the names where they are now, and has room for another "count" slots.
+int slotTableUsable(vector table, int count) {
+  return table && *(atom *)vectorData(table) == gcStats.compactions && vectorLength(table) - 1 >= count * 2;
+}
+void addToSlotTable(vector table, obj name, int i) {
+  int capacity = vectorLength(table) - 1, h = slotHash(name, capacity);
+  atom *t = vectorData(table);
+  while (t[h + 1]) h = h + 1 & capacity - 1;
+  t[h + 1] = i + 1;
+}
+
+// A new shape with the slot added to those of the given one.
+vector extendedShape(vector shape, obj name, obj namespace) {
+  vector layout = shapeLayout(shape);
+  int count = shapeSlotCount(shape);
+  // Only the layouts of hashed shapes have room to spare.
+  if (count * 2 < vectorLength(layout)
+      && __sync_bool_compare_and_swap((vector *)idxPointer(layout, count * 2), NULL, writeBarrier(name))) {
+    setIdx(layout, count * 2 + 1, namespace);
+    vector next = newShape(layout, count + 1), table = idx(shape, 2);
+    // Checked after allotting the shape, which may have compacted the heap.
+    if (slotTableUsable(table, count + 1)) {
+      addToSlotTable(table, name, count);
+      setIdx(next, 2, table);
+    }
+    return next;
+  }
+  vector newLayout = makeVector(count < HASHED_SLOTS ? count * 2 + 2 : count * 4 + 4);
+  memcpy(vectorData(newLayout), vectorData(layout), count * 2 * sizeof(atom));
+  shadeReferences(newLayout);
+  setIdx(newLayout, count * 2, name);
+  setIdx(newLayout, count * 2 + 1, namespace);
+  return newShape(newLayout, count + 1);
+}
+// The shape of an object of the given shape once the slot is added to it.
+vector shapeWith(vector shape, obj name, obj namespace) {
+  for (;;) {
+    vector transitions = idx(shape, 1);
+    int n = vectorLength(transitions);
+    for (int i = 0; i < n; i += 3)
+      if (idx(transitions, i) == name && idx(transitions, i + 1) == namespace) return idx(transitions, i + 2);
+    vector next = extendedShape(shape, name, namespace), newTransitions = makeVector(n + 3);
+    memcpy(vectorData(newTransitions), vectorData(transitions), n * sizeof(atom));
+    shadeReferences(newTransitions);
+    setIdx(newTransitions, n, name);
+    setIdx(newTransitions, n + 1, namespace);
+    setIdx(newTransitions, n + 2, next);
+    // Another thread may have added a transition meanwhile, perhaps this one.
+    if (__sync_bool_compare_and_swap((vector *)idxPointer(shape, 1), transitions, writeBarrier(newTransitions)))
+      return next;
+  }
 }
 
+vector slotTable(vector shape) {
+  vector table = idx(shape, 2);
+  int count = shapeSlotCount(shape), capacity = 1;
+  if (slotTableUsable(table, count)) return table;
+  while (capacity < count * 2) capacity *= 2;
+  table = zero(makeAtomVector(capacity + 1));
+  vector layout = shapeLayout(shape); // Read after allotting, in case the names were moved meanwhile.
+  *(atom *)vectorData(table) = gcStats.compactions;
+  for (int i = 0; i < count; i++) addToSlotTable(table, idx(layout, i * 2), i);
+  setIdx(shape, 2, table);
+  return table;
+}
+// The index of the next slot of the shape with the given name, after the one found last time, or -1. The
+// cursor starts out at -1, and is left where the search stopped. Slots are found in the order they were
+// added, whether the shape is hashed or not.
+int nextSlotNamed(vector shape, obj name, int *cursor) {
+  vector layout = shapeLayout(shape);
+  int count = shapeSlotCount(shape);
+  if (count <= HASHED_SLOTS) {
+    for (int i = *cursor + 1; i < count; i++)
+      if (idx(layout, i * 2) == name) return *cursor = i;
+    return *cursor = -1;
+  }
+  vector table = slotTable(shape);
+  int capacity = vectorLength(table) - 1;
+  atom *t = vectorData(table);
+  for (int h = *cursor < 0 ? slotHash(name, capacity) : *cursor + 1 & capacity - 1; t[h + 1];
+       h = h + 1 & capacity - 1)
+    if (t[h + 1] <= count && idx(layout, (t[h + 1] - 1) * 2) == name) {
+      *cursor = h;
+      return t[h + 1] - 1;
+    }
+  return *cursor = -1;
+}
 
 obj newObject(obj proto, vector slotNames, vector slotValues, void *hidden) {
   int count = vectorLength(slotNames);
-  vector slots = makeVector(count * 3);
+  if (!count) return newVector(4, proto, emptySlots, hidden, 0);
+  vector shape = emptyShape(), values = makeVector(count + 1);
   for (int i = 0; i < count; ++i) {
-    setIdx(slots, i * 3, idx(slotNames, i));
-    setIdx(slots, i * 3 + 1, idx(slotValues, i));
-    setIdx(slots, i * 3 + 2, oNamespaceCanon);
+    shape = shapeWith(shape, idx(slotNames, i), oNamespaceCanon);
+    setIdx(values, i + 1, idx(slotValues, i));
   }
-  return newVector(4, proto, slots, hidden, 0);
+  setIdx(values, 0, shape);
+  return newVector(4, proto, values, hidden, 0);
 }
 
 vector  proto(obj o)          { return     idx(o, 0);     }
@@ -717,43 +2334,69 @@ vector  slots(obj o)          { return     idx(o, 1);     }
 vector  hiddenEntity(obj o)   { return     idx(o, 2);     }
 void   *hiddenAtom(obj o)     { return idx(idx(o, 2), 0); }
 obj     dispatchMethod(obj o) { return     idx(o, 3);     }
+vector  objectShape(obj o)    { return idx(idx(o, 1), 0); }
+
+void changedObject(obj o) {
+  if (marking || isMarked(o)) __sync_fetch_and_add(&lookupEpoch, 1);
+}
 
 obj setProto(obj o, obj p) {
   setIdx(o, 0, p);
+  changedObject(o);
   return o;
 }
-void setSlots(obj o, vector s) {
-  setIdx(o, 1, s);
+// Replace the slots of o with those given as (name, value, namespace) triples.
+void setSlots(obj o, vector triples) {
+  int count = vectorLength(triples) / 3;
+  vector shape = emptyShape(), values = count ? makeVector(count + 1) : emptySlots;
+  for (int i = 0; i < count; ++i) {
+    shape = shapeWith(shape, idx(triples, i * 3), idx(triples, i * 3 + 2));
+    setIdx(values, i + 1, idx(triples, i * 3 + 1));
+  }
+  if (count) setIdx(values, 0, shape);
+  setIdx(o, 1, values);
+  changedObject(o);
 }
 vector setHiddenData(obj o, vector h) {
   return setIdx(o, 2, h);
 }
 void setDispatchMethod(obj o, obj dm) {
   setIdx(o, 3, dm);
+  changedObject(o);
 }
 
 int slotCount(obj o) {
-  return vectorLength(slots(o)) / 3;
+  return shapeSlotCount(objectShape(o));
 }
 obj slotName(obj o, int i) {
-  return idx(slots(o), i * 3);
+  return idx(shapeLayout(objectShape(o)), i * 2);
 }
 void **slotValuePointer(obj o, int i) {
-  return (void **)idxPointer(slots(o), i * 3 + 1);
+  return (void **)idxPointer(slots(o), i + 1);
 }
 obj slotNamespace(obj o, int i) {
-  return idx(slots(o), i * 3 + 2);
+  return idx(shapeLayout(objectShape(o)), i * 2 + 1);
 }
 
+// The values grow into the room left at their end, doubling when there's none, so that an object given n
+// slots one at a time is only copied log n times.
 obj newSlot(obj o, obj s, void *v, obj namespace) {
-  vector oldSlots = slots(o);
-  int length = vectorLength(oldSlots);
-  vector newSlots = makeVector(length + 3);
-  memcpy(vectorData(newSlots), vectorData(oldSlots), length * sizeof(atom)); // TODO: Write barrier.
-  setIdx(newSlots, length,     s);
-  setIdx(newSlots, length + 1, v);
-  setIdx(newSlots, length + 2, namespace);
-  setSlots(o, newSlots);
+  vector values = slots(o), shape = shapeWith(objectShape(o), s, namespace);
+  int count = shapeSlotCount(shape);
+  if (count < vectorLength(values)) {
+    setIdx(values, count, v);
+    __sync_synchronize(); // The value has to be there before the shape says so.
+    setIdx(values, 0, shape);
+    changedObject(o);
+    return v;
+  }
+  vector newValues = makeVector(count * 2 + 1);
+  memcpy(vectorData(newValues), vectorData(values), vectorLength(values) * sizeof(atom));
+  shadeReferences(newValues);
+  setIdx(newValues, 0, shape);
+  setIdx(newValues, count, v);
+  setIdx(o, 1, newValues);
+  changedObject(o);
   return v;
 }
 
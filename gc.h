@@ -22,13 +22,13 @@
 // A compiler hint.
 #define tailcall(t_f) do { (t_f)(); return; } while (0)
 
-#define EDEN_OVERHEAD 5 // For the sake of testing.
+#define EDEN_OVERHEAD 0 // For the sake of testing.
 
 #include <gmp.h> // For the definition of "mpz_t".
 #include <stdint.h> // For the definition of "intptr_t".
+#include <stdio.h> // For the definition of "FILE".
 
 typedef struct vectorStruct {
-  struct vectorStruct *prev, *next;
   int type;
   void *data[];
 } *vector;
@@ -56,10 +56,12 @@ void mark(vector);
 
 // The following are only exposed because they're used in unit tests.
 void scan(void);
+void addWhiteSegment(vector);
+vector takeWhiteSegment(int);
 void acquireFutex(volatile int *, volatile int *);
 void releaseFutex(volatile int *, volatile int *);
-vector insertBetween(vector, vector, vector);
-extern vector blackList, grayList, whiteList, ecruList;
+vector addThread(vector);
+void killThreadData(vector);
 
 extern vector emptyVector;
 extern vector garbageCollectorRoot;
@@ -82,7 +84,33 @@ void acquireTempLock(void);
 void releaseTempLock(void);
 int freeSpaceCount(void);
 
+#define VECTOR_TYPES 14
+extern const char *vectorTypeNames[VECTOR_TYPES];
+
+typedef struct {
+  long cellsSweptLazily,  // By the allocator, outside of any pause.
+       cellsSweptInPause, // Left over when the next collection started.
+       compactions,
+       minorCollections,
+       fullCollections,   // Including those that finish an incremental cycle.
+       incrementalCycles,
+       cellsAllotted,     // Since startup, including headers.
+       pauseNanoseconds,  // With the world stopped, in total and at most.
+       longestPauseNanoseconds,
+       // As of the end of the last full sweep or compaction:
+       liveCells,
+       freeCells,
+       largestFreeSegment,
+       liveVectors[VECTOR_TYPES], // By type, named in vectorTypeNames.
+       largeCells,        // Currently mapped in for the large vector space.
+       cellsReleased;     // From white segments, back to the system, since startup.
+} gcStatistics;
+extern gcStatistics gcStats;
+gcStatistics garbageCollectorStatistics(void);
+
 void invalidateEden(void);
+int protectEden(void);
+void restoreEden(int);
 
 vector makeVector(int);
 vector makeAtomVector(int);
@@ -96,16 +124,23 @@ vector idx(vector, int);
 atom atomIdx(vector, int);
 
 vector *idxPointer(vector, int);
-vector *edenIdx(vector, int);
 void *setIdx(vector, int, void *);
+void *writeBarrier(void *);
+vector shadeReferences(vector);
 void *vectorData(vector);
 
 int vectorLength(vector);
 
 vector zero(vector);
 
+// Call the function each time the current thread has allotted another so many cells, or never, given zero.
+void sampleAllocations(int, void (*)(void));
+
 void forbidGC(void);
 void permitGC(void);
+void safepoint(void);
+// Run a function that may block for a long time, and mustn't touch the heap, without holding up collections.
+void blockingCall(void (*)(void));
 
 void createPrimitiveThread(void (*)(void *), void *);
 // NOTE: The first argument to spawn() must be a function name. A function pointer expression would
@@ -131,8 +166,21 @@ promise enqueueMessage(vector, obj, vector);
 void initializeHeap(void);
 
 void collectGarbage(void);
+void collectYoungGarbage(void);
+void compactGarbage(void);
+void writeHeapCensus(FILE *);
+const char *globalName(vector);
+void requestHeapCensus(int); // A signal handler.
 void requireGC(void);
 
+// Have the collector call the function on the vector once it has become garbage.
+vector registerFinalizer(vector, void (*)(vector));
+
+// Vectors that the collector empties once their referent, or their key, can't be reached otherwise. An
+// ephemeron's value is only kept alive through it for as long as its key is.
+vector newWeakReference(vector);
+vector newEphemeron(vector, vector);
+
 int isPromise(vector);
 int isActor(vector);
 
@@ -145,6 +193,8 @@ int isStackFrame(obj);
 int isVectorObject(obj);
 int isEnvironment(obj);
 int isRegex(obj);
+int isWeakReference(obj);
+int isEphemeronTable(obj);
 
 obj vectorObject(vector);
 vector vectorObjectVector(obj);
@@ -166,6 +216,9 @@ void setVectorType(vector, int);
 vector suffix(void *, vector);
 vector prefix(void *, vector);
 
+// Changes whenever a lookup through old objects might give a different result.
+extern volatile atom lookupEpoch;
+
 obj dispatchMethod(obj);
 void setDispatchMethod(obj, obj);
 
@@ -173,6 +226,10 @@ obj newSlot(obj, obj, void *, obj);
 vector hiddenEntity(obj);
 void *hiddenAtom(obj);
 void setSlots(obj, vector);
+vector slots(obj); // The object's shape, followed by the values of its slots.
+vector objectShape(obj);
+vector shapeLayout(vector); // The name and namespace of each slot, in turn, perhaps followed by room to grow.
+int nextSlotNamed(vector, obj, int *);
 int slotCount(obj);
 obj slotName(obj, int);
 obj slotNamespace(obj, int);
@@ -195,6 +252,7 @@ int (*primitiveCode(obj))(void);
 obj stackFrame(obj, vector, vector, vector);
 vector stackFrameContinuation(obj);
 
+void initializeShapes(void);
 void initializePrototypeTags(void);
 
 #endif
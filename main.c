@@ -20,9 +20,11 @@
 #include "objects.h"
 #include "death.h"
 #include <unistd.h>
+#include <signal.h>
 
 int main(int argc, char **argv) {
   setupInterpreter();
+  signal(SIGUSR1, requestHeapCensus); // Writes a census of the heap to the working directory.
   if (argc > 2) die("Too many arguments.");
   vector a = newActor(oInternals, oNave, oDynamicEnvironment);
   waitFor(enqueueMessage(a, sLoadFile_, newVector(1, string("canon.gs"))));
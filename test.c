@@ -21,6 +21,7 @@
 #include "core.c"
 
 #include <string.h>
+#include <dirent.h>
 
 #define test(name, ...) \
   void test_##name() { \
@@ -55,10 +56,11 @@ test(appendStrings,
   assert_string_equal(stringData(appendStrings(s1, s2)), "foobar");
 )
 test(freeSpaceCount,
+  invalidateEden();
   int oldCount = freeSpaceCount();
   newVector(0);
   // Free space should now be reduced by the size of a zero-length vector and its edenspace.
-  assert_equal(freeSpaceCount(), oldCount - 3 - EDEN_OVERHEAD);
+  assert_equal(freeSpaceCount(), oldCount - 1 - EDEN_OVERHEAD);
 )
 test(spawn,
   void *p = newPromise();
@@ -101,46 +103,472 @@ test(deepLookup,
   assert_false(deepLookup(o, symbol("notASlot"), c));
   assert_equal(*deepLookup(o, s, c), v); 
 )
-test(insertBetween,
-  void *prev[3], *next[3], *middle[3], *single[3];
-  vector p = (vector)prev, n = (vector)next, m = (vector)middle, s = (vector)single;
-  p->next = n;
-  n->prev = p;
-  assert_equal(m, insertBetween(m, p, n));
-  assert_equal(m, p->next);
-  assert_equal(m, n->prev);
-  assert_equal(m->prev, p);
-  assert_equal(m->next, n);
-  s->prev = s->next = s;
-  assert_equal(m, insertBetween(m, s->prev, s));
-  assert_equal(m->next, s);
-  assert_equal(m->prev, s);
-  assert_equal(s->next, m);
-  assert_equal(s->prev, m);
+test(inlineCache,
+  obj s = symbol("inlineCached"),
+      base = newObject(oObject, newVector(1, s), newVector(1, integer(1)), emptyVector),
+      middle = slotlessObject(base, emptyVector),
+      leaf = slotlessObject(middle, emptyVector),
+      code = message(quote(leaf), s, emptyVector);
+  shelter(currentThread, newVector(2, code, base));
+  collectGarbage(); // Only lookups through old objects are remembered.
+  assert_equal(integerValue(testcall(code, sInterpret, emptyVector)), 1);
+  vector cache = codeInlineCache(code);
+  int entries = 0;
+  for (int i = 0; i < INLINE_CACHE_ENTRIES; ++i) if (idx(cache, i)) entries++;
+  assert_equal(entries, 1);
+  assert_equal(integerValue(testcall(code, sInterpret, emptyVector)), 1);
+  newSlot(middle, s, integer(2), oNamespaceCanon);
+  assert_equal(integerValue(testcall(code, sInterpret, emptyVector)), 2);
+  setProto(leaf, base);
+  assert_equal(integerValue(testcall(code, sInterpret, emptyVector)), 1);
+)
+test(lookupCache,
+  obj s = symbol("globallyCached"),
+      base = newObject(oObject, newVector(1, s), newVector(1, integer(1)), emptyVector),
+      middle = slotlessObject(base, emptyVector),
+      leaf = slotlessObject(middle, emptyVector);
+  shelter(currentThread, leaf);
+  collectGarbage();
+  assert_equal(integerValue(testcall(leaf, s, emptyVector)), 1); // Sent without a call site.
+  obj holder, shape = objectShape(leaf), namespaces = hiddenEntity(oDynamicEnvironment);
+  int i;
+  assert_true(cachedLookup(lookupEpoch, shape, middle, s, namespaces, &holder, &i));
+  assert_equal(holder, base);
+  collectYoungGarbage(); // Old objects stay put, so minor collections keep the entry.
+  assert_true(cachedLookup(lookupEpoch, shape, middle, s, namespaces, &holder, &i));
+  newSlot(middle, s, integer(2), oNamespaceCanon);
+  assert_false(cachedLookup(lookupEpoch, shape, middle, s, namespaces, &holder, &i));
+  assert_equal(integerValue(testcall(leaf, s, emptyVector)), 2);
+)
+test(codeSubexpressions,
+  obj inner = message(quote(integer(1)), sIdentity, emptyVector),
+      outer = message(inner, sIdentity, emptyVector);
+  assert_equal(integerValue(testcall(outer, sInterpret, emptyVector)), 1);
+  setMessageTarget(inner, quote(integer(2)));
+  assert_equal(integerValue(testcall(outer, sInterpret, emptyVector)), 2);
+  newSlot(inner, sInterpret, integer(3), oNamespaceCanon); // Which must then be sent interpret after all.
+  assert_equal(integerValue(testcall(outer, sInterpret, emptyVector)), 3);
+)
+test(reenteredCodeSubexpressions,
+  // "o record: (o capture) identity", where record: resumes the continuation that capture kept twice, each
+  // time returning a new value through the code subexpressions that were started directly.
+  obj o = slotlessObject(oObject, emptyVector);
+  int calls = 0, received = 0;
+  int capture() {
+    setHiddenData(o, threadContinuation(currentThread));
+    messageReturn(integer(0));
+  }
+  int record() {
+    received = received * 10 + integerValue(arg(currentThread, 0)) + 1;
+    if (++calls < 3) {
+      setContinuation(hiddenEntity(o));
+      messageReturn(integer(calls));
+    }
+    messageReturn(integer(received));
+  }
+  addCanonSlot(o, symbol("capture"), primitive(capture));
+  addCanonSlot(o, symbol("record:"), primitive(record));
+  obj code = message(quote(o),
+                     symbol("record:"),
+                     newVector(1, message(message(quote(o), symbol("capture"), emptyVector),
+                                          sIdentity,
+                                          emptyVector)));
+  assert_equal(integerValue(testcall(code, sInterpret, emptyVector)), 123);
+  assert_equal(calls, 3);
 )
 test(collectGarbage,
   invalidateEden();
   collectGarbage();
-  // One of the placeholder vectors (either black or gray, whichever role is not being played by
-  // "emptyVector") will have survived the first collection due to being created with its mark bit
-  // set, although it's not really live. We must collect again to get an accurate count.
-  collectGarbage();
   int n = freeSpaceCount();
   collectGarbage();
   assert_equal(freeSpaceCount(), n);
   // Testing only one vector size has failed to reveal intermittent memory leaks in the past.
   for (int i = 0; i < 1000; i++) {
-    makeVector(0);
+    makeVector(1); // Garbage, leaving a hole big enough to be a white segment of its own.
     invalidateEden();
     makeVector(i);
     collectGarbage();
-    assert_equal(n - freeSpaceCount(), 3 + i + EDEN_OVERHEAD);
+    assert_equal(n - freeSpaceCount(), 1 + i + EDEN_OVERHEAD);
   }
   invalidateEden();
   collectGarbage();
   assert_equal(freeSpaceCount(), n);
 )
+test(parallelMarking,
+  // Wide enough to give every marker something to steal, and deep enough to keep them busy. The unreachable
+  // vectors are only referred to weakly, so that they're known to have been left unmarked once the weak
+  // references to them are emptied.
+  int width = 64, depth = 1000, unmarked = 0, reached = 0;
+  invalidateEden();
+  vector chains = makeVector(width), weak = 0;
+  for (int i = 0; i < width; i++) {
+    vector chain = 0, lost = 0;
+    for (int j = 0; j < depth; j++) {
+      chain = newVector(2, chain, makeVector(1));
+      lost = newVector(2, lost, makeVector(1));
+      weak = newVector(2, newWeakReference(lost), weak);
+    }
+    setIdx(chains, i, chain);
+  }
+  invalidateEden();
+  shelter(currentThread, newVector(2, chains, weak));
+  collectGarbage(); // Finishing any cycle that the allocations started, which left them black.
+  collectGarbage();
+  vector root = shelteredValue(currentThread);
+  for (int i = 0; i < width; i++)
+    for (vector v = idx(idx(root, 0), i); v; v = idx(v, 0)) unmarked += !isMarked(v) + !isMarked(idx(v, 1));
+  assert_equal(unmarked, 0);
+  for (vector w = idx(root, 1); w; w = idx(w, 1)) reached += idx(idx(w, 0), 0) != 0;
+  assert_equal(reached, 0);
+  invalidateEden();
+)
+test(protectEden,
+  invalidateEden();
+  vector v = makeVector(1);
+  setIdx(v, 0, integer(42));
+  int floor = protectEden();
+  invalidateEden(); // As a nested call's doNext() would, leaving the caller's temporaries alone.
+  collectGarbage();
+  assert_true(isMarked(v));
+  assert_equal(integerValue(idx(v, 0)), 42);
+  restoreEden(floor);
+  invalidateEden();
+)
+test(compactGarbage,
+  invalidateEden();
+  pair l = emptyList;
+  for (int i = 0; i < 100; i++) {
+    makeVector(i % 7); // Garbage, to leave holes between the list's cells.
+    l = cons(integer(i), l);
+  }
+  invalidateEden();
+  shelter(currentThread, newVector(2, l, 0));
+  long compactions = gcStats.compactions;
+  compactGarbage();
+  assert_equal(gcStats.compactions, compactions + 1);
+  for (int i = 99; i >= 0; i--, l = cdr(l)) assert_equal(integerValue(car(l)), i);
+  assert_true(empty(l));
+  invalidateEden();
+)
+test(collectYoungGarbage,
+  invalidateEden();
+  vector old = makeVector(1);
+  invalidateEden();
+  shelter(currentThread, newVector(2, old, 0));
+  collectGarbage(); // Promoting "old".
+  setIdx(old, 0, integer(42)); // A young value reachable only through an old vector.
+  for (int i = 0; i < 100; i++) makeVector(i % 7);
+  invalidateEden();
+  shelter(currentThread, newVector(2, old, 0));
+  int n = freeSpaceCount();
+  long minorCollections = gcStats.minorCollections;
+  collectYoungGarbage();
+  assert_equal(gcStats.minorCollections, minorCollections + 1);
+  assert_true(isMarked(idx(old, 0)));
+  assert_equal(integerValue(idx(old, 0)), 42);
+  assert_true(freeSpaceCount() > n);
+  invalidateEden();
+)
+test(registerFinalizer,
+  int finalized = 0;
+  void count(vector v) { finalized++; }
+  invalidateEden();
+  vector kept = registerFinalizer(makeVector(0), count);
+  registerFinalizer(makeVector(0), count);
+  invalidateEden();
+  shelter(currentThread, newVector(2, kept, 0));
+  collectGarbage();
+  assert_equal(finalized, 1);
+  invalidateEden();
+  collectGarbage();
+  assert_equal(finalized, 2);
+)
+test(whiteSegments,
+  invalidateEden();
+  vector small = makeAtomVector(5), large = makeAtomVector(700);
+  // Each is taken back before anything else can be allotted from it.
+  addWhiteSegment(small);
+  addWhiteSegment(large);
+  assert_equal(takeWhiteSegment(5), small); // From its own class.
+  assert_equal(takeWhiteSegment(700), large); // The first of its class, which it fits exactly.
+  addWhiteSegment(large);
+  assert_equal(takeWhiteSegment(639), large); // From the first class with room for the excess as well.
+  // Whatever is taken either fits exactly or leaves room for a header to split the excess off.
+  int misfits = 0;
+  for (int n = 1; n < 5000; n++) {
+    vector v = takeWhiteSegment(n);
+    misfits += !v || vectorLength(v) != n && vectorLength(v) < n + 1;
+    if (v) addWhiteSegment(v);
+  }
+  assert_equal(misfits, 0);
+  invalidateEden();
+)
+test(lazySweep,
+  int finalized = 0, intact = 0;
+  void check(vector v) {
+    finalized++;
+    intact += *(atom *)vectorData(v) == 0x5ea1;
+  }
+  invalidateEden();
+  collectGarbage();
+  collectGarbage(); // So that nothing allotted below is left black by an earlier cycle.
+  for (int i = 0; i < 1000; i++) {
+    *(atom *)vectorData(registerFinalizer(makeAtomVector(1), check)) = 0x5ea1;
+    integer((long)i << 40);
+    vector r = makeAtomVector(CELLS_REQUIRED_FOR_BYTES(sizeof(regex_t)));
+    regcomp(vectorData(r), "a*b", 0);
+    registerFinalizer(r, freeRegex);
+    makeVector(i % 7);
+  }
+  invalidateEden();
+  collectGarbage();
+  collectGarbage(); // The garbage may have started a cycle of its own, leaving some of it for this one.
+  // Everything was finalized before the sweep could hand out any of its cells again.
+  assert_equal(finalized, 1000);
+  assert_equal(intact, 1000);
+  long swept = gcStats.cellsSweptLazily;
+  for (int i = 0; i < 1000; i++) integer(i);
+  invalidateEden();
+  assert_true(gcStats.cellsSweptLazily > swept);
+)
+test(weakReferences,
+  invalidateEden();
+  vector kept = makeVector(0),
+         weak = newWeakReference(kept),
+         lost = newWeakReference(makeVector(0)),
+         // The second ephemeron's key is reachable only through the first one's value.
+         key = makeVector(0),
+         chained = makeVector(0),
+         e2 = newEphemeron(chained, makeVector(1)),
+         e1 = newEphemeron(key, newVector(1, chained)),
+         e3 = newEphemeron(makeVector(0), makeVector(1));
+  invalidateEden();
+  shelter(currentThread, newVector(7, kept, weak, lost, key, e2, e1, e3));
+  collectGarbage();
+  assert_equal(idx(weak, 0), kept);
+  assert_equal(idx(lost, 0), NULL);
+  assert_equal(idx(e2, 0), chained);
+  assert_true(isMarked(idx(e2, 1)));
+  assert_equal(idx(e3, 0), NULL);
+  assert_equal(idx(e3, 1), NULL);
+  invalidateEden();
+)
+test(ephemeronTableFreeEntries,
+  invalidateEden();
+  obj table = newEphemeronTable(),
+      kept = slotlessObject(oObject, emptyVector),
+      removed = slotlessObject(oObject, emptyVector);
+  ephemeronTablePut(table, kept, integer(1));
+  ephemeronTablePut(table, removed, integer(2));
+  vector e = ephemeronEntry(table, removed); // As removeKey: empties it.
+  setIdx(e, 0, NULL);
+  setIdx(e, 1, NULL);
+  invalidateEden();
+  shelter(currentThread, newVector(2, table, kept));
+  collectGarbage(); // The unused entries' keys are NULL.
+  collectYoungGarbage();
+  assert_equal(integerValue(idx(ephemeronEntry(table, kept), 1)), 1);
+  vector entries = hiddenEntity(table);
+  int unused = 0;
+  for (int i = 0; i < vectorLength(entries); i++)
+    if (!idx(idx(entries, i), 0)) {
+      unused++;
+      assert_equal(idx(idx(entries, i), 1), NULL);
+    }
+  assert_equal(unused, EPHEMERON_TABLE_CAPACITY - 1);
+  invalidateEden();
+)
+test(garbageCollectorStatistics,
+  long collections = garbageCollectorStatistics().fullCollections;
+  collectGarbage();
+  freeSpaceCount(); // Finishing the sweep, which publishes the live counts.
+  gcStatistics s = garbageCollectorStatistics();
+  assert_equal(s.fullCollections, collections + 1);
+  assert_true(s.cellsAllotted > 0);
+  assert_true(s.liveCells > 0);
+  long vectors = 0;
+  for (int i = 0; i < VECTOR_TYPES; i++) vectors += s.liveVectors[i];
+  assert_true(vectors > 0);
+  continuation c = newContinuation(0, 0, 0, 0, 0, oDynamicEnvironment, 0);
+  assert_equal(integerValue(*shallowLookup(garbageCollectorStatisticsObject(), sLiveCells, c)), s.liveCells);
+)
+test(writeHeapCensus,
+  string("census"); // Kept by the eden.
+  FILE *f = tmpfile();
+  writeHeapCensus(f);
+  rewind(f);
+  char line[256], name[128];
+  long objects, cells, strings = 0;
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "prototype %127s %ld %ld", name, &objects, &cells) == 3 && !strcmp(name, "oString"))
+      strings = objects;
+  fclose(f);
+  assert_true(strings > 0);
+)
+test(requestHeapCensus,
+  char cwd[4096], dir[] = "/tmp/gospel-census-XXXXXX";
+  assert_true(getcwd(cwd, sizeof(cwd)) && mkdtemp(dir));
+  // A census that can't be written is given up, without taking the program down.
+  assert_equal(chdir("/proc"), 0);
+  requestHeapCensus(0);
+  safepoint();
+  // The next request is still honoured, once.
+  assert_equal(chdir(dir), 0);
+  requestHeapCensus(0);
+  safepoint();
+  safepoint();
+  int censuses = 0;
+  DIR *d = opendir(".");
+  for (struct dirent *e; (e = readdir(d));)
+    if (strstr(e->d_name, ".census")) {
+      censuses++;
+      unlink(e->d_name);
+    }
+  closedir(d);
+  assert_equal(chdir(cwd), 0);
+  rmdir(dir);
+  assert_equal(censuses, 1);
+)
+test(profileAllocations,
+  obj churn = symbol("churn");
+  setContinuation(newContinuation(0, churn, newVector(1, string("target")), emptyVector, 0, oDynamicEnvironment, 0));
+  profileAllocations(16);
+  for (int i = 0; i < 100; i++) makeVector(i);
+  profileAllocations(0);
+  FILE *f = tmpfile();
+  writeAllocationProfile(f);
+  rewind(f);
+  char line[256], selector[128], prototype[128];
+  long samples = 0, bytes;
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "site %127s %127s %ld %ld", selector, prototype, &samples, &bytes) == 4
+        && !strcmp(selector, "churn") && !strcmp(prototype, "oString"))
+      break;
+  fclose(f);
+  assert_true(samples > 0);
+)
+test(largeVector,
+  invalidateEden();
+  collectGarbage();
+  long large = garbageCollectorStatistics().largeCells;
+  vector v = makeVector(64 * 1024);
+  assert_true(garbageCollectorStatistics().largeCells > large);
+  setIdx(v, 64 * 1024 - 1, integer(42));
+  invalidateEden();
+  shelter(currentThread, newVector(2, v, 0));
+  collectGarbage();
+  assert_true(isMarked(v));
+  assert_equal(integerValue(idx(v, 64 * 1024 - 1)), 42);
+  invalidateEden();
+  collectGarbage();
+  assert_equal(garbageCollectorStatistics().largeCells, large);
+)
+test(blockingCall,
+  promise done = newPromise();
+  vector i = integer(42);
+  volatile int released = 0;
+  void block() { while (!released); }
+  void f() {
+    blockingCall(block);
+    killThreadData(currentThread);
+    fulfillPromise(done, i);
+  }
+  spawn(f, addThread(garbageCollectorRoot));
+  // The collection waits for the other thread to park, which it does while it's blocked.
+  long collections = gcStats.fullCollections;
+  collectGarbage();
+  assert_equal(gcStats.fullCollections, collections + 1);
+  released = -1;
+  assert_equal(waitFor(done), i);
+)
+test(releasePages,
+  invalidateEden();
+  vector middle;
+  for (int i = 0; i < 1000; i++) {
+    vector v = makeVector(100);
+    if (i == 500) middle = v;
+  }
+  invalidateEden();
+  atom *p = (atom *)idxPointer(middle, 50);
+  *p = 42; // Garbage now, so never traced.
+  long released = garbageCollectorStatistics().cellsReleased;
+  collectGarbage();
+  freeSpaceCount(); // Finishing the sweep.
+  assert_true(garbageCollectorStatistics().cellsReleased > released);
+  assert_equal(*p, 0); // The page was given back, and mapped in again, zeroed.
+)
 
+test(shapes,
+  obj a = symbol("a"), b = symbol("b"),
+      o1 = slotlessObject(oNull, emptyVector),
+      o2 = slotlessObject(oNull, emptyVector),
+      o3 = newObject(oNull, newVector(2, a, b), newVector(2, integer(1), integer(2)), emptyVector);
+  assert_equal(objectShape(o1), objectShape(o2));
+  vector values;
+  for (int i = 0; i < 8; i++) {
+    newSlot(o1, symbol(i % 2 ? "b" : "a"), integer(i), oNamespaceCanon);
+    if (i == 0) values = slots(o1);
+    if (i == 1) {
+      assert_equal(slots(o1), values); // Grown into the room left.
+      assert_equal(objectShape(o1), objectShape(o3));
+    }
+  }
+  assert_equal(slotCount(o1), 8);
+  assert_equal(integerValue(*slotValuePointer(o1, 7)), 7);
+  assert_equal(slotName(o1, 6), a);
+  newSlot(o2, b, integer(2), oNamespaceCanon);
+  assert_not_equal(objectShape(o2), objectShape(o3));
+)
+test(hashedSlots,
+  obj o = slotlessObject(oNull, emptyVector), other = slotlessObject(oNull, emptyVector);
+  continuation c = newContinuation(0, 0, 0, 0, 0, oDynamicEnvironment, 0);
+  char name[16];
+  for (int i = 0; i < 100; i++) {
+    sprintf(name, "slot%d", i);
+    newSlot(o, symbol(name), integer(i), currentNamespace(c));
+    newSlot(other, symbol(name), integer(i), currentNamespace(c));
+  }
+  assert_equal(objectShape(o), objectShape(other));
+  newSlot(o, symbol("slot7"), integer(-1), currentNamespace(c)); // Hidden by the first.
+  shelter(currentThread, newVector(3, o, other, c));
+  compactGarbage(); // Which may move the names that the slots are hashed by.
+  for (int i = 0; i < 100; i++) {
+    sprintf(name, "slot%d", i);
+    assert_equal(integerValue(*shallowLookup(o, symbol(name), c)), i);
+  }
+  assert_false(shallowLookup(o, symbol("slot"), c));
+)
+test(manySlots,
+  // The second object copies the first's layout once they differ, from where the first extends it in place.
+  obj o = slotlessObject(oNull, emptyVector), other = slotlessObject(oNull, emptyVector);
+  continuation c = newContinuation(0, 0, 0, 0, 0, oDynamicEnvironment, 0);
+  char name[16];
+  int layouts = 0, wrong = 0;
+  vector layout = NULL;
+  int found(obj o, char *name, int value) {
+    void **slot = shallowLookup(o, symbol(name), c);
+    return slot && integerValue(*slot) == value;
+  }
+  for (int i = 0; i < 3000; i++) {
+    sprintf(name, "many%d", i);
+    newSlot(o, symbol(name), integer(i), currentNamespace(c));
+    wrong += !found(o, name, i);
+    if (shapeLayout(objectShape(o)) != layout) layouts++;
+    layout = shapeLayout(objectShape(o));
+    if (i % 2 == 0) sprintf(name, "other%d", i);
+    newSlot(other, symbol(name), integer(-i), currentNamespace(c));
+  }
+  assert_true(layouts < 50); // A layout per slot up to HASHED_SLOTS, and then only when it doubles.
+  shelter(currentThread, newVector(3, o, other, c));
+  compactGarbage(); // Which may move the names that the slots are hashed by.
+  for (int i = 0; i < 3000; i++) {
+    sprintf(name, "many%d", i);
+    wrong += !found(o, name, i) + (i % 2 ? !found(other, name, -i) : !!shallowLookup(other, symbol(name), c));
+    sprintf(name, "other%d", i);
+    wrong += !!shallowLookup(o, symbol(name), c) + (i % 2 == 0 && !found(other, name, -i));
+  }
+  assert_equal(wrong, 0);
+)
 test(addSlot,
   obj o = newObject(oNull, emptyVector, emptyVector, 0),
       s = symbol("foo"),
@@ -155,17 +583,14 @@ test(mark,
   obj i = integer(42);
   mark(i);
   assert_true(isMarked(i));
-  assert_equal(i->next, blackList);
 )
 test(scan,
   obj i = integer(42);
   vector v = newVector(1, i);
   mark(v);
-  grayList = v;
   scan();
-  assert_equal(v->next, i);
-  assert_equal(i->prev, v);
-  assert_equal(i->next, blackList);
+  assert_true(isMarked(v));
+  assert_true(isMarked(i));
 )
 test(stringLength,
   obj s = string("");